@@ -0,0 +1,219 @@
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "bench.h"
+#include "obj_loader.h"
+#include "texture.h"
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+static bool same_vectors(const std::vector<Vec3f> &a, const std::vector<Vec3f> &b) {
+    if (a.size()!=b.size()) return false;
+    for (size_t i=0; i<a.size(); i++)
+        for (int k=0; k<3; k++)
+            if (a[i][k]!=b[i][k]) return false;
+    return true;
+}
+
+static bool same_data(const ObjData &a, const ObjData &b) {
+    if (!same_vectors(a.verts, b.verts) || !same_vectors(a.norms, b.norms)) return false;
+    if (a.uv.size()!=b.uv.size() || a.corners.size()!=b.corners.size()) return false;
+    for (size_t i=0; i<a.uv.size(); i++)
+        if (a.uv[i].x!=b.uv[i].x || a.uv[i].y!=b.uv[i].y) return false;
+    for (size_t i=0; i<a.corners.size(); i++)
+        for (int k=0; k<3; k++)
+            if (a.corners[i][k]!=b.corners[i][k]) return false;
+    return true;
+}
+
+int bench_obj_load(const char *filename, int repeats) {
+    std::vector<char> buffer;
+    if (!read_file(filename, buffer)) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return 1;
+    }
+    double mb = buffer.size()/(1024.*1024.);
+    ObjData legacy, fast, parallel;
+    double t_legacy = 1e30, t_fast = 1e30, t_parallel = 1e30; // best of the repeats
+    for (int r=0; r<repeats; r++) {
+        legacy = ObjData();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        load_obj_legacy(filename, legacy);
+        t_legacy = std::min(t_legacy, seconds_since(start));
+
+        fast = ObjData();
+        start = std::chrono::steady_clock::now();
+        load_obj(filename, fast, 1);
+        t_fast = std::min(t_fast, seconds_since(start));
+
+        parallel = ObjData();
+        start = std::chrono::steady_clock::now();
+        load_obj(filename, parallel);
+        t_parallel = std::min(t_parallel, seconds_since(start));
+    }
+    printf("%s: %.2f MB, %d triangles, best of %d\n", filename, mb, (int)fast.corners.size()/3, repeats);
+    printf("  legacy  %8.2f ms  %8.1f MB/s\n", t_legacy*1e3, mb/t_legacy);
+    printf("  fast    %8.2f ms  %8.1f MB/s  x%.1f\n", t_fast*1e3, mb/t_fast, t_legacy/t_fast);
+    printf("  threads %8.2f ms  %8.1f MB/s  x%.1f\n", t_parallel*1e3, mb/t_parallel, t_legacy/t_parallel);
+    printf("  results %s\n", same_data(legacy, fast) ? "identical" : "differ (the legacy parser only reads v/vt/vn faces)");
+    if (!same_data(fast, parallel)) {
+        printf("  threaded parse differs from the serial one\n");
+        return 1;
+    }
+    return 0;
+}
+
+// sum of all channels, keeps the lookups from being optimized away and compares the two layouts
+template <class FetchT> static unsigned long long sum_texels(const std::vector<Vec2i> &points, FetchT fetch) {
+    unsigned long long sum = 0;
+    for (size_t i=0; i<points.size(); i++) {
+        TGAColor c = fetch(points[i].x, points[i].y);
+        sum += c.bgra[0] + c.bgra[1] + c.bgra[2] + c.bgra[3];
+    }
+    return sum;
+}
+
+int bench_texture(const char *filename, int repeats) {
+    TGAImage image;
+    if (!image.read_tga_file(filename)) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return 1;
+    }
+    Texture texture;
+    texture.assign(image);
+    int w = image.get_width(), h = image.get_height();
+
+    const int n = 1<<22;
+    std::vector<Vec2i> patterns[3];
+    const char *names[3] = { "random", "coherent", "rotated" };
+    srand(1);
+    for (int i=0; i<n; i++) patterns[0].push_back(Vec2i((int)((long long)rand()*rand()%w), (int)((long long)rand()*rand()%h)));
+    for (int i=0; i<n; i++) patterns[1].push_back(Vec2i(i%w, i/w%h));
+    // rows of a square grid turned by 60 degrees about the center, 1 texel apart, all inside the image
+    int side = (int)(std::min(w, h)*.7f);
+    float cs = std::cos(1.0472f), sn = std::sin(1.0472f);
+    for (int i=0; i<n; i++) {
+        float a = i%side - side*.5f, b = i/side%side - side*.5f;
+        patterns[2].push_back(Vec2i((int)(w*.5f + a*cs - b*sn), (int)(h*.5f + a*sn + b*cs)));
+    }
+
+    printf("%s: %dx%d, %d bytes per pixel, %d lookups per pattern, best of %d\n", filename, w, h, image.get_bytespp(), n, repeats);
+    bool same = true;
+    for (int p=0; p<3; p++) {
+        double t_image = 1e30, t_texture = 1e30;
+        unsigned long long s_image = 0, s_texture = 0;
+        for (int r=0; r<repeats; r++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            s_image = sum_texels(patterns[p], [&](int x, int y) { return image.get(x, y); });
+            t_image = std::min(t_image, seconds_since(start));
+
+            start = std::chrono::steady_clock::now();
+            s_texture = sum_texels(patterns[p], [&](int x, int y) { return texture.fetch(x, y); });
+            t_texture = std::min(t_texture, seconds_since(start));
+        }
+        printf("  %-8s TGAImage::get %6.2f ns  Texture::fetch %6.2f ns  x%.2f\n", names[p], t_image*1e9/n, t_texture*1e9/n, t_image/t_texture);
+        same = same && s_image==s_texture;
+    }
+    printf("  texels %s\n", same ? "identical" : "differ");
+    return same ? 0 : 1;
+}
+
+int bench_tga_load(const char *filename, int repeats) {
+    std::vector<char> file;
+    if (!read_file(filename, file)) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return 1;
+    }
+    TGAImage legacy, fast;
+    double t_legacy = 1e30, t_fast = 1e30; // best of the repeats
+    bool ok = true;
+    for (int r=0; r<repeats; r++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ok = legacy.read_tga_file_legacy(filename) && ok;
+        t_legacy = std::min(t_legacy, seconds_since(start));
+
+        start = std::chrono::steady_clock::now();
+        ok = fast.read_tga_file(filename) && ok;
+        t_fast = std::min(t_fast, seconds_since(start));
+    }
+    if (!ok) {
+        std::cerr << "can't decode " << filename << std::endl;
+        return 1;
+    }
+    size_t nbytes = (size_t)fast.get_width()*fast.get_height()*fast.get_bytespp();
+    double mb = file.size()/(1024.*1024.), mb_pixels = nbytes/(1024.*1024.);
+    printf("%s: %.2f MB file, %.2f MB of pixels, best of %d\n", filename, mb, mb_pixels, repeats);
+    printf("  legacy  %8.2f ms  %8.1f MB/s in  %8.1f MB/s out\n", t_legacy*1e3, mb/t_legacy, mb_pixels/t_legacy);
+    printf("  buffer  %8.2f ms  %8.1f MB/s in  %8.1f MB/s out  x%.1f\n", t_fast*1e3, mb/t_fast, mb_pixels/t_fast, t_legacy/t_fast);
+    bool same = legacy.get_width()==fast.get_width() && legacy.get_height()==fast.get_height() &&
+                legacy.get_bytespp()==fast.get_bytespp() && fast.buffer() && !memcmp(legacy.buffer(), fast.buffer(), nbytes);
+    printf("  pixels %s\n", same ? "identical" : "differ");
+    return same ? 0 : 1;
+}
+
+// reads back what write_tga_file() produced, false when the pixels differ from image
+static bool same_image(TGAImage &image, const char *filename) {
+    TGAImage back;
+    if (!back.read_tga_file(filename)) return false;
+    size_t nbytes = (size_t)image.get_width()*image.get_height()*image.get_bytespp();
+    return back.get_width()==image.get_width() && back.get_height()==image.get_height() &&
+           back.get_bytespp()==image.get_bytespp() && !memcmp(back.buffer(), image.buffer(), nbytes);
+}
+
+int bench_tga_write(const char *filename, int repeats, int stripe_rows) {
+    TGAImage image;
+    if (!image.read_tga_file(filename)) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return 1;
+    }
+    const char *out = "bench_write.tga";
+    size_t nbytes = (size_t)image.get_width()*image.get_height()*image.get_bytespp();
+    double mb_pixels = nbytes/(1024.*1024.);
+    printf("%s: %dx%d, %.2f MB of pixels, stripes of %d rows, best of %d\n", filename, image.get_width(), image.get_height(),
+           mb_pixels, stripe_rows, repeats);
+    struct Mode { const char *name; bool rle; int stripe_rows; int threads; };
+    const Mode modes[4] = { { "raw", false, 0, 1 }, { "rle", true, 0, 1 },
+                            { "striped", true, stripe_rows, 1 }, { "threads", true, stripe_rows, 0 } };
+    std::vector<char> files[4];
+    bool ok = true;
+    for (int m=0; m<4; m++) {
+        double t = 1e30;
+        for (int r=0; r<repeats; r++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            ok = image.write_tga_file(out, modes[m].rle, modes[m].stripe_rows, modes[m].threads) && ok;
+            t = std::min(t, seconds_since(start));
+        }
+        ok = read_file(out, files[m]) && ok;
+        bool same = same_image(image, out);
+        printf("  %-8s %8.2f ms  %8.1f MB/s  %9d bytes  %s\n", modes[m].name, t*1e3, mb_pixels/t, (int)files[m].size(),
+               same ? "reads back identical" : "reads back different");
+        ok = ok && same;
+    }
+    // the striped file must not depend on the thread count
+    bool deterministic = files[2]==files[3];
+    printf("  striped files %s\n", deterministic ? "identical for 1 and all threads" : "differ between thread counts");
+    std::remove(out);
+    return ok && deterministic ? 0 : 1;
+}
+
+int run_bench(int argc, char **argv) {
+    if (argc>=2 && !strcmp(argv[0], "obj"))
+        return bench_obj_load(argv[1], argc>=3 ? std::max(1, atoi(argv[2])) : 5);
+    if (argc>=2 && !strcmp(argv[0], "texture"))
+        return bench_texture(argv[1], argc>=3 ? std::max(1, atoi(argv[2])) : 5);
+    if (argc>=2 && !strcmp(argv[0], "tga"))
+        return bench_tga_load(argv[1], argc>=3 ? std::max(1, atoi(argv[2])) : 5);
+    if (argc>=2 && !strcmp(argv[0], "tgawrite"))
+        return bench_tga_write(argv[1], argc>=3 ? std::max(1, atoi(argv[2])) : 5, argc>=4 ? std::max(1, atoi(argv[3])) : 64);
+    std::cerr << "usage: bench obj <file.obj> [repeats]" << std::endl;
+    std::cerr << "       bench texture <file.tga> [repeats]" << std::endl;
+    std::cerr << "       bench tga <file.tga> [repeats]" << std::endl;
+    std::cerr << "       bench tgawrite <file.tga> [repeats] [stripe rows]" << std::endl;
+    return 1;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// micro benchmarks, run as "SoftRenderer bench <name> [args]"
+int run_bench(int argc, char **argv);
+
+// times load_obj_legacy() against the serial and threaded load_obj() and checks that they return the same data
+int bench_obj_load(const char *filename, int repeats);
+
+// times TGAImage::get() against the tiled Texture::fetch() for random, coherent (row by row)
+// and rotated (rows at 60 degrees) texel walks over a .tga file and checks that they read the same texels
+int bench_texture(const char *filename, int repeats);
+
+// times TGAImage::read_tga_file_legacy() against the buffered read_tga_file() and checks that they decode the same pixels
+int bench_tga_load(const char *filename, int repeats);
+
+// times write_tga_file() raw, RLE compressed as one stream and in stripes of stripe_rows rows on one and on all threads,
+// prints the file sizes, checks that all of them read back to the same pixels
+// and that the striped file does not depend on the thread count
+int bench_tga_write(const char *filename, int repeats, int stripe_rows);
@@ -0,0 +1,92 @@
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+#include "depthbuffer.h"
+
+DepthBuffer::DepthBuffer() : data(), width(0), height(0), format(FLOAT32), hiz(), hiz_dirty(), hiz2(), hiz2_dirty(),
+    hiz_w(0), hiz_h(0), hiz2_w(0), hiz2_h(0) {
+}
+
+DepthBuffer::DepthBuffer(int w, int h, int fmt) : data(), width(w), height(h), format(fmt), hiz(), hiz_dirty(), hiz2(), hiz2_dirty() {
+    hiz_w  = (width +HIZ_TILE -1)/HIZ_TILE;
+    hiz_h  = (height+HIZ_TILE -1)/HIZ_TILE;
+    hiz2_w = (width +HIZ_TILE2-1)/HIZ_TILE2;
+    hiz2_h = (height+HIZ_TILE2-1)/HIZ_TILE2;
+    data.resize((size_t)width*height);
+    hiz.resize(hiz_w*hiz_h);
+    hiz_dirty.resize(hiz_w*hiz_h);
+    hiz2.resize(hiz2_w*hiz2_h);
+    hiz2_dirty.resize(hiz2_w*hiz2_h);
+    clear();
+}
+
+void DepthBuffer::update_hiz(int tx, int ty) {
+    int x1 = std::min(width,  (tx+1)*HIZ_TILE);
+    int y1 = std::min(height, (ty+1)*HIZ_TILE);
+    unsigned int m = 0xffffffffu;
+    for (int y=ty*HIZ_TILE; y<y1; y++)
+        for (int x=tx*HIZ_TILE; x<x1; x++)
+            m = std::min(m, data[x+y*width]);
+    hiz[tx+ty*hiz_w] = m;
+    hiz_dirty[tx+ty*hiz_w] = 0;
+}
+
+void DepthBuffer::update_hiz2(int tx, int ty) {
+    const int n = HIZ_TILE2/HIZ_TILE;
+    int x1 = std::min(hiz_w, (tx+1)*n);
+    int y1 = std::min(hiz_h, (ty+1)*n);
+    unsigned int m = 0xffffffffu;
+    for (int y=ty*n; y<y1; y++)
+        for (int x=tx*n; x<x1; x++)
+            m = std::min(m, hiz_min(x, y));
+    hiz2[tx+ty*hiz2_w] = m;
+    hiz2_dirty[tx+ty*hiz2_w] = 0;
+}
+
+void DepthBuffer::clear(float z) {
+    unsigned int code = encode(z);
+    if (!code) {
+        if (!data.empty()) memset(&data[0], 0, data.size()*sizeof(unsigned int));
+    } else {
+        std::fill(data.begin(), data.end(), code);
+    }
+    std::fill(hiz.begin(),  hiz.end(),  code);
+    std::fill(hiz2.begin(), hiz2.end(), code);
+    std::fill(hiz_dirty.begin(),  hiz_dirty.end(),  0);
+    std::fill(hiz2_dirty.begin(), hiz2_dirty.end(), 0);
+}
+
+TGAImage DepthBuffer::to_tga() const {
+    TGAImage img(width, height, TGAImage::GRAYSCALE);
+    unsigned char *dst = img.buffer();
+    for (size_t i=0; i<data.size(); i++) {
+        float z = decode(data[i])*(255.f/DEPTH_MAX);
+        dst[i] = (unsigned char)std::min(255, (int)(z+.5f));
+    }
+    return img;
+}
+
+bool DepthBuffer::write_pfm_file(const char *filename) const {
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    bool ok = write_pfm(f);
+    ok = fclose(f)==0 && ok;
+    if (!ok) std::cerr << "can't dump the pfm file\n";
+    return ok;
+}
+
+bool DepthBuffer::write_pfm(FILE *f) const {
+    // a negative scale marks little endian floats, the floats are written in the byte order of this machine
+    const unsigned int one = 1;
+    bool little = *(const unsigned char *)&one==1;
+    fprintf(f, "Pf\n%d %d\n%s\n", width, height, little ? "-1.0" : "1.0");
+    std::vector<float> row(width);
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) row[x] = decode(data[x+y*width]);
+        if (fwrite(row.data(), sizeof(float), row.size(), f)!=row.size()) return false;
+    }
+    return !ferror(f);
+}
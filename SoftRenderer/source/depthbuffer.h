@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <string.h>
+#include <algorithm>
+#include "tgaimage.h"
+
+const float DEPTH_MAX = 255.f; // viewport() maps depth to [0, DEPTH_MAX], larger is closer
+
+// Depth values are kept as 32-bit codes that order the same way as the depths:
+// FLOAT32 stores the bits of the (non negative) float, UNORM24 stores round(z/DEPTH_MAX*(2^24-1)).
+// The depth test is then a plain integer compare for both formats.
+class DepthBuffer {
+protected:
+    std::vector<unsigned int> data;
+    int width;
+    int height;
+    int format;
+    // hierarchical z: farthest code per HIZ_TILE and per HIZ_TILE2 square, recomputed lazily once marked dirty
+    // there are no locks: tiled drawing relies on every HIZ_TILE2 square lying inside a single raster tile,
+    // so that no two workers touch the same entry (TILE_SIZE must be a multiple of HIZ_TILE2)
+    std::vector<unsigned int>  hiz;
+    std::vector<unsigned char> hiz_dirty;
+    std::vector<unsigned int>  hiz2;
+    std::vector<unsigned char> hiz2_dirty;
+    int hiz_w, hiz_h;
+    int hiz2_w, hiz2_h;
+
+    void update_hiz(int tx, int ty);
+    void update_hiz2(int tx, int ty);
+public:
+    static const int HIZ_TILE  = 8;
+    static const int HIZ_TILE2 = 64; // HIZ_TILE2/HIZ_TILE level 1 tiles per side
+    enum Format {
+        FLOAT32=0, UNORM24=1
+    };
+
+    DepthBuffer();
+    DepthBuffer(int w, int h, int fmt=FLOAT32);
+
+    unsigned int encode(float z) const {
+        z = z>0.f ? (z<DEPTH_MAX ? z : DEPTH_MAX) : 0.f;
+        if (format==UNORM24) return std::min(0xffffffu, (unsigned int)(z*(0xffffff/DEPTH_MAX)+.5f));
+        unsigned int bits;
+        memcpy(&bits, &z, sizeof(bits));
+        return bits;
+    }
+    float decode(unsigned int code) const {
+        if (format==UNORM24) return code*(DEPTH_MAX/0xffffff);
+        float z;
+        memcpy(&z, &code, sizeof(z));
+        return z;
+    }
+
+    // unchecked access, (x,y) must be inside the buffer
+    // row() and set_code() do not maintain the hierarchical z, call hiz_touch() for the written tiles
+    unsigned int *row(int y) { return &data[y*width]; }
+    bool test(int x, int y, unsigned int code) const { return data[x+y*width]<=code; }
+    unsigned int get_code(int x, int y) const { return data[x+y*width]; }
+    void set_code(int x, int y, unsigned int code) { data[x+y*width] = code; }
+    float get(int x, int y) const { return decode(data[x+y*width]); }
+    void set(int x, int y, float z) { data[x+y*width] = encode(z); hiz_touch(x/HIZ_TILE, y/HIZ_TILE); }
+
+    // farthest code inside level 1 tile (tx,ty) resp. level 2 tile (tx,ty), never above the true value
+    unsigned int hiz_min(int tx, int ty) {
+        int i = tx+ty*hiz_w;
+        if (hiz_dirty[i]) update_hiz(tx, ty);
+        return hiz[i];
+    }
+    unsigned int hiz_min2(int tx, int ty) {
+        int i = tx+ty*hiz2_w;
+        if (hiz2_dirty[i]) update_hiz2(tx, ty);
+        return hiz2[i];
+    }
+    // call after writing depth inside level 1 tile (tx,ty)
+    void hiz_touch(int tx, int ty) {
+        hiz_dirty[tx+ty*hiz_w] = 1;
+        hiz2_dirty[tx*HIZ_TILE/HIZ_TILE2+ty*HIZ_TILE/HIZ_TILE2*hiz2_w] = 1;
+    }
+
+    void clear(float z=0.f);
+    TGAImage to_tga() const; // GRAYSCALE debug view, depth rounded to [0,255]
+    // PFM (Pf, one float channel) of the depths in [0, DEPTH_MAX] without rounding. PFM rows run from the bottom up,
+    // row 0 of the buffer is written first, the same picture as the flipped to_tga()
+    bool write_pfm_file(const char *filename) const;
+    bool write_pfm(FILE *f) const;
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    int get_format() const { return format; }
+};
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include "image_writer.h"
+
+ImageWriter::ImageWriter(size_t max_pending) : queue_(), max_pending_(std::max<size_t>(1, max_pending)), busy_(0), stop_(false) {
+    thread_ = std::thread(&ImageWriter::run, this);
+}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    not_empty_.notify_all();
+    thread_.join();
+}
+
+std::future<bool> ImageWriter::write(TGAImage &image, const std::string &filename, bool rle) {
+    std::unique_ptr<Job> job(new Job());
+    job->image.swap(image);
+    job->filename = filename;
+    job->rle = rle;
+    std::future<bool> result = job->done.get_future();
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return queue_.size()<max_pending_; });
+        queue_.push_back(std::move(job));
+    }
+    not_empty_.notify_one();
+    return result;
+}
+
+void ImageWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [&] { return queue_.empty() && !busy_; });
+}
+
+void ImageWriter::run() {
+    for (;;) {
+        std::unique_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) return; // stopped, the queue is drained
+            job = std::move(queue_.front());
+            queue_.pop_front();
+            busy_++;
+        }
+        not_full_.notify_all();
+        // an exception (bad_alloc for the RLE staging buffer of a large image) goes to the future,
+        // so the thread keeps running and busy_ still drops back for wait() and the destructor
+        try {
+            job->done.set_value(job->image.write_tga_file(job->filename.c_str(), job->rle));
+        } catch (...) {
+            job->done.set_exception(std::current_exception());
+        }
+        job.reset(); // frees the pixels before wait() returns
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            busy_--;
+        }
+        not_full_.notify_all();
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include "tgaimage.h"
+
+// encodes and writes finished images on a background thread, so the RLE encoding and the disk I/O
+// overlap with the next frame instead of following it
+class ImageWriter {
+    struct Job {
+        TGAImage image;
+        std::string filename;
+        bool rle;
+        std::promise<bool> done;
+    };
+    std::deque<std::unique_ptr<Job> > queue_;
+    size_t max_pending_;
+    int busy_;                          // jobs taken by the thread and not finished yet
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_; // signals the thread
+    std::condition_variable not_full_;  // signals write() and wait()
+    std::thread thread_;
+
+    void run();
+public:
+    // max_pending: queued images before write() blocks, bounds the memory held by the queue
+    explicit ImageWriter(size_t max_pending=2);
+    ~ImageWriter(); // writes what is still queued
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter &operator =(const ImageWriter &) = delete;
+
+    // takes the pixels of image, which is left empty, and queues write_tga_file(filename, rle);
+    // blocks while max_pending images are waiting. The future holds the result of write_tga_file(),
+    // or the exception it threw
+    std::future<bool> write(TGAImage &image, const std::string &filename, bool rle=true);
+    // returns once every queued image is written
+    void wait();
+};
@@ -1,10 +1,21 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include "tgaimage.h"
 #include "model.h"
 #include "geometry.h"
 #include "our_gl.h"
+#include "bench.h"
+#include "mesh_opt.h"
+#include "image_writer.h"
 
 Model* model = NULL;
 
@@ -17,7 +28,7 @@ const int width = 800;
 const int height = 800;
 
 //ɫ
-struct GouraudShader : public IShader
+struct GouraudShader final : public IShader
 {
 	Vec3f varying_intensity;
 	mat<2, 3, float> varying_uv;
@@ -29,11 +40,8 @@ struct GouraudShader : public IShader
 		Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
 		varying_uv.set_col(nthvert, model->uv(iface, nthvert));
 
-		mat<4, 4, float> uniform_M = Projection * ModelView;
-		mat<4, 4, float> uniform_MIT = (Projection * ModelView).invert_transpose();
-		gl_Vertex = Viewport * uniform_M * gl_Vertex;
+		gl_Vertex = uniforms.mvp * gl_Vertex;
 
-		Vec3f normal = model->normal(iface, nthvert).normalize();
 		varying_intensity[nthvert] = std::max(0.1f, model->normal(iface, nthvert) * light_dir);
 		return gl_Vertex;
 	}
@@ -42,15 +50,73 @@ struct GouraudShader : public IShader
 	virtual bool fragment(Vec3f bar, TGAColor& color)
 	{
 		Vec2f uv = varying_uv * bar;
-		TGAColor c = model->diffuse(uv);
+		TGAColor c = model->diffuse(uv, uv_lod(varying_uv * bar_dx, varying_uv * bar_dy), uniforms.texture_filter);
 		float intensity = varying_intensity * bar;
 		color = c * intensity;
 		return false;
 	}
+
+	virtual int fragment8(const FragmentBatch& in, ColorBatch& out)
+	{
+		float8 b0 = float8::load(in.bar[0]), b1 = float8::load(in.bar[1]), b2 = float8::load(in.bar[2]);
+		float8 u = b0 * varying_uv[0][0] + b1 * varying_uv[0][1] + b2 * varying_uv[0][2];
+		float8 v = b0 * varying_uv[1][0] + b1 * varying_uv[1][1] + b2 * varying_uv[1][2];
+		//TGAColor::operator*һ£ǿȽضϵ[0,1]
+		float8 intensity = min(max(b0 * varying_intensity[0] + b1 * varying_intensity[1] + b2 * varying_intensity[2], 0.f), 1.f);
+		float us[8], vs[8];
+		u.store(us);
+		v.store(vs);
+		float tex[4][8] = {};
+		float lod = uv_lod(varying_uv * bar_dx, varying_uv * bar_dy);
+		for (int k = 0; k < 8; k++)
+		{
+			if (!(in.mask >> k & 1)) continue;
+			TGAColor c = model->diffuse(Vec2f(us[k], vs[k]), lod, uniforms.texture_filter);
+			for (int i = 0; i < 4; i++) tex[i][k] = c[i];
+		}
+		for (int i = 0; i < 4; i++) out.set_channel(i, float8::load(tex[i]) * intensity);
+		return in.mask;
+	}
+
+	virtual IShader* clone() const { return new GouraudShader(*this); }
+
+	//ƣuv͹ǿ
+	virtual int nvaryings() const { return 3; }
+
+	virtual Vec4f shade_vertex(int ivert, float* varyings) const
+	{
+		const MeshVertex& v = model->vertex(ivert);
+		varyings[0] = v.uv.x;
+		varyings[1] = v.uv.y;
+		varyings[2] = std::max(0.1f, v.normal * light_dir);
+		return uniforms.mvp * embed<4>(v.pos);
+	}
+
+	virtual void load_varyings(const float* v0, const float* v1, const float* v2)
+	{
+		const float* v[3] = { v0, v1, v2 };
+		for (int i = 0; i < 3; i++)
+		{
+			varying_uv.set_col(i, Vec2f(v[i][0], v[i][1]));
+			varying_intensity[i] = v[i][2];
+		}
+	}
+
+	virtual bool save_varyings(float* v0, float* v1, float* v2) const
+	{
+		float* v[3] = { v0, v1, v2 };
+		for (int i = 0; i < 3; i++)
+		{
+			v[i][0] = varying_uv[0][i];
+			v[i][1] = varying_uv[1][i];
+			v[i][2] = varying_intensity[i];
+		}
+		return true;
+	}
 };
 
 //һֵڵĹǿȸ滻Ϊһ
-struct ToonShader : public IShader {
+struct ToonShader final : public IShader {
 	mat<3, 3, float> varying_tri;
 	Vec3f          varying_ity;
 
@@ -58,12 +124,12 @@ struct ToonShader : public IShader {
 
 	virtual Vec4f vertex(int iface, int nthvert) {
 		Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-		gl_Vertex = Projection * ModelView * gl_Vertex;
+		gl_Vertex = uniforms.proj_mv * gl_Vertex;
 		varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
 
 		varying_ity[nthvert] = model->normal(iface, nthvert) * light_dir;
 
-		gl_Vertex = Viewport * gl_Vertex;
+		gl_Vertex = uniforms.viewport * gl_Vertex;
 		return gl_Vertex;
 	}
 
@@ -78,10 +144,56 @@ struct ToonShader : public IShader {
 		color = TGAColor(255, 155, 0) * intensity;
 		return false;
 	}
+
+	virtual int fragment8(const FragmentBatch& in, ColorBatch& out) {
+		float8 intensity = float8::load(in.bar[0]) * varying_ity[0] + float8::load(in.bar[1]) * varying_ity[1] + float8::load(in.bar[2]) * varying_ity[2];
+		//ֵӵ͵θ
+		float8 level(.15f);
+		level = select(intensity > .15f, float8(.30f), level);
+		level = select(intensity > .30f, float8(.45f), level);
+		level = select(intensity > .45f, float8(.60f), level);
+		level = select(intensity > .60f, float8(.80f), level);
+		level = select(intensity > .85f, float8(1.f), level);
+		out.set_channel(0, level * 0.f);
+		out.set_channel(1, level * 155.f);
+		out.set_channel(2, level * 255.f);
+		out.set_channel(3, level * 255.f);
+		return in.mask;
+	}
+
+	virtual IShader* clone() const { return new ToonShader(*this); }
+
+	virtual int nvaryings() const { return 4; }
+
+	virtual Vec4f shade_vertex(int ivert, float* varyings) const {
+		const MeshVertex& v = model->vertex(ivert);
+		Vec4f gl_Vertex = uniforms.proj_mv * embed<4>(v.pos);
+		Vec3f tri = proj<3>(gl_Vertex / gl_Vertex[3]);
+		for (int i = 0; i < 3; i++) varyings[i] = tri[i];
+		varyings[3] = v.normal * light_dir;
+		return uniforms.viewport * gl_Vertex;
+	}
+
+	virtual void load_varyings(const float* v0, const float* v1, const float* v2) {
+		const float* v[3] = { v0, v1, v2 };
+		for (int i = 0; i < 3; i++) {
+			varying_tri.set_col(i, Vec3f(v[i][0], v[i][1], v[i][2]));
+			varying_ity[i] = v[i][3];
+		}
+	}
+
+	virtual bool save_varyings(float* v0, float* v1, float* v2) const {
+		float* v[3] = { v0, v1, v2 };
+		for (int i = 0; i < 3; i++) {
+			for (int k = 0; k < 3; k++) v[i][k] = varying_tri[k][i];
+			v[i][3] = varying_ity[i];
+		}
+		return true;
+	}
 };
 
 //ԷвֵԴαߵĲ
-struct FlatShader : public IShader {
+struct FlatShader final : public IShader {
 	//Ϣ
 	mat<3, 3, float> varying_tri;
 
@@ -89,9 +201,9 @@ struct FlatShader : public IShader {
 
 	virtual Vec4f vertex(int iface, int nthvert) {
 		Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-		gl_Vertex = Projection * ModelView * gl_Vertex;
+		gl_Vertex = uniforms.proj_mv * gl_Vertex;
 		varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-		gl_Vertex = Viewport * gl_Vertex;
+		gl_Vertex = uniforms.viewport * gl_Vertex;
 		return gl_Vertex;
 	}
 
@@ -102,60 +214,229 @@ struct FlatShader : public IShader {
 		color = TGAColor(255, 255, 255) * intensity;
 		return false;
 	}
+
+	virtual int fragment8(const FragmentBatch& in, ColorBatch& out) {
+		//ɫֻͬһ
+		TGAColor color;
+		fragment(Vec3f(), color);
+		for (int k = 0; k < 8; k++) memcpy(out.bgra[k], color.bgra, 4);
+		return in.mask;
+	}
+
+	virtual IShader* clone() const { return new FlatShader(*this); }
+
+	virtual int nvaryings() const { return 3; }
+
+	virtual Vec4f shade_vertex(int ivert, float* varyings) const {
+		Vec4f gl_Vertex = uniforms.proj_mv * embed<4>(model->vertex(ivert).pos);
+		Vec3f tri = proj<3>(gl_Vertex / gl_Vertex[3]);
+		for (int i = 0; i < 3; i++) varyings[i] = tri[i];
+		return uniforms.viewport * gl_Vertex;
+	}
+
+	virtual void load_varyings(const float* v0, const float* v1, const float* v2) {
+		varying_tri.set_col(0, Vec3f(v0[0], v0[1], v0[2]));
+		varying_tri.set_col(1, Vec3f(v1[0], v1[1], v1[2]));
+		varying_tri.set_col(2, Vec3f(v2[0], v2[1], v2[2]));
+	}
+
+	virtual bool save_varyings(float* v0, float* v1, float* v2) const {
+		float* v[3] = { v0, v1, v2 };
+		for (int i = 0; i < 3; i++)
+			for (int k = 0; k < 3; k++) v[i][k] = varying_tri[k][i];
+		return true;
+	}
 };
 
 //Phongɫ
-struct PhongShader : public IShader {
+struct PhongShader final : public IShader {
 	mat<2, 3, float> varying_uv;  // same as above
-	mat<4, 4, float> uniform_M = Projection * ModelView;
-	mat<4, 4, float> uniform_MIT = ModelView.invert_transpose();
+	Vec3f uniform_l;              // light direction transformed by Projection*ModelView, once per draw
+	virtual void prepare(const Uniforms& u) {
+		IShader::prepare(u);
+		uniform_l = proj<3>(u.proj_mv * embed<4>(light_dir)).normalize();
+	}
 	virtual Vec4f vertex(int iface, int nthvert) {
 		varying_uv.set_col(nthvert, model->uv(iface, nthvert));
 		Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read the vertex from .obj file
-		return Viewport * Projection * ModelView * gl_Vertex; // transform it to screen coordinates
+		return uniforms.mvp * gl_Vertex; // transform it to screen coordinates
 	}
 	virtual bool fragment(Vec3f bar, TGAColor& color) {
 		Vec2f uv = varying_uv * bar;
-		Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(uv))).normalize();
-		Vec3f l = proj<3>(uniform_M * embed<4>(light_dir)).normalize();
+		float lod = uv_lod(varying_uv * bar_dx, varying_uv * bar_dy);
+		Vec3f n = proj<3>(uniforms.mv_it * embed<4>(model->normal(uv, lod, uniforms.texture_filter))).normalize();
+		Vec3f l = uniform_l;
 		Vec3f r = (n * (n * l * 2.f) - l).normalize();   // reflected light
-		float spec = pow(std::max(r.z, 0.0f), model->specular(uv));
+		float spec = pow(std::max(r.z, 0.0f), model->specular(uv, lod, uniforms.texture_filter));
 		float diff = std::max(0.f, n * l);
-		TGAColor c = model->diffuse(uv);
+		TGAColor c = model->diffuse(uv, lod, uniforms.texture_filter);
 		color = c;
 		for (int i = 0; i < 3; i++) color[i] = std::min<float>(5 + c[i] * (diff + .6 * spec), 255);
 		return false;
 	}
+
+	virtual int fragment8(const FragmentBatch& in, ColorBatch& out) {
+		float8 b0 = float8::load(in.bar[0]), b1 = float8::load(in.bar[1]), b2 = float8::load(in.bar[2]);
+		float8 u = b0 * varying_uv[0][0] + b1 * varying_uv[0][1] + b2 * varying_uv[0][2];
+		float8 v = b0 * varying_uv[1][0] + b1 * varying_uv[1][1] + b2 * varying_uv[1][2];
+		float us[8], vs[8];
+		u.store(us);
+		v.store(vs);
+		//ͨУ8һ
+		float nm[3][8], shininess[8], tex[4][8] = {};
+		float lod = uv_lod(varying_uv * bar_dx, varying_uv * bar_dy);
+		for (int k = 0; k < 8; k++)
+		{
+			if (!(in.mask >> k & 1)) {
+				nm[0][k] = nm[1][k] = 0.f;
+				nm[2][k] = shininess[k] = 1.f;
+				continue;
+			}
+			Vec2f uv(us[k], vs[k]);
+			Vec3f n = model->normal(uv, lod, uniforms.texture_filter);
+			for (int i = 0; i < 3; i++) nm[i][k] = n[i];
+			shininess[k] = model->specular(uv, lod, uniforms.texture_filter);
+			TGAColor c = model->diffuse(uv, lod, uniforms.texture_filter);
+			for (int i = 0; i < 4; i++) tex[i][k] = c[i];
+		}
+		float8 nx = float8::load(nm[0]), ny = float8::load(nm[1]), nz = float8::load(nm[2]);
+		const Matrix& MIT = uniforms.mv_it;
+		vec3f8 n = normalize(vec3f8(
+			nx * MIT[0][0] + ny * MIT[0][1] + nz * MIT[0][2] + MIT[0][3],
+			nx * MIT[1][0] + ny * MIT[1][1] + nz * MIT[1][2] + MIT[1][3],
+			nx * MIT[2][0] + ny * MIT[2][1] + nz * MIT[2][2] + MIT[2][3]));
+		vec3f8 l(uniform_l.x, uniform_l.y, uniform_l.z);
+		float8 nl = dot(n, l);
+		vec3f8 r = normalize(n * (nl * 2.f) - l);
+		float rz[8], spec[8];
+		max(r.z, 0.f).store(rz);
+		for (int k = 0; k < 8; k++) spec[k] = pow(rz[k], shininess[k]);
+		float8 light = max(nl, 0.f) + float8::load(spec) * .6f;
+		for (int i = 0; i < 3; i++) out.set_channel(i, min(float8::load(tex[i]) * light + 5.f, 255.f));
+		out.set_channel(3, float8::load(tex[3]));
+		return in.mask;
+	}
+
+	virtual IShader* clone() const { return new PhongShader(*this); }
+
+	virtual int nvaryings() const { return 2; }
+
+	virtual Vec4f shade_vertex(int ivert, float* varyings) const {
+		const MeshVertex& v = model->vertex(ivert);
+		varyings[0] = v.uv.x;
+		varyings[1] = v.uv.y;
+		return uniforms.mvp * embed<4>(v.pos);
+	}
+
+	virtual void load_varyings(const float* v0, const float* v1, const float* v2) {
+		varying_uv.set_col(0, Vec2f(v0[0], v0[1]));
+		varying_uv.set_col(1, Vec2f(v1[0], v1[1]));
+		varying_uv.set_col(2, Vec2f(v2[0], v2[1]));
+	}
+
+	virtual bool save_varyings(float* v0, float* v1, float* v2) const {
+		float* v[3] = { v0, v1, v2 };
+		for (int i = 0; i < 3; i++) {
+			v[i][0] = varying_uv[0][i];
+			v[i][1] = varying_uv[1][i];
+		}
+		return true;
+	}
 };
 
+//eyecenterȾģͣimagezbuffer
+static void render(Vec3f eye, TGAImage& image, DepthBuffer& zbuffer)
+{
+	lookat(eye, center, up);
+	projection(-1.f / (eye - center).norm());
+	viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+	image.clear();
+	zbuffer.clear();
+
+	PhongShader shader;
+	draw_indexed<PhongShader>(model->nfaces(), model->indices(), model->nvertices(), shader, image, zbuffer);
+}
+
+// "SoftRenderer stream <ppm|raw> [frames] [fd]": renders a turntable of frames around the up axis and writes them
+// one after the other to the file descriptor fd (1 = stdout), as binary PPM or as bare rgb24 pixels,
+// e.g. "SoftRenderer stream raw 120 | ffmpeg -f rawvideo -pixel_format rgb24 -video_size 800x800 -i - out.mp4"
+static int stream_frames(int argc, char** argv)
+{
+	bool raw = !strcmp(argv[0], "raw"); // the format is checked by main()
+	int frames = argc >= 2 ? std::max(1, atoi(argv[1])) : 1;
+	int fd = argc >= 3 ? atoi(argv[2]) : 1;
+#ifdef _WIN32
+	_setmode(fd, _O_BINARY);
+	FILE* out = fd == 1 ? stdout : _fdopen(fd, "wb");
+#else
+	FILE* out = fd == 1 ? stdout : fdopen(fd, "wb");
+#endif
+	if (!out) {
+		std::cerr << "can't open file descriptor " << fd << std::endl;
+		return 1;
+	}
+	std::cerr << "# streaming " << frames << " frames " << width << "x" << height << (raw ? " rgb24" : " ppm") << std::endl;
+
+	TGAImage image(width, height, TGAImage::RGB);
+	DepthBuffer zbuffer(width, height, DepthBuffer::FLOAT32);
+	Vec3f offset = camera - center;
+	bool ok = true;
+	for (int i = 0; i < frames && ok; i++) {
+		float a = 6.2831853f * i / frames;
+		Vec3f eye = center + Vec3f(offset.x * std::cos(a) + offset.z * std::sin(a), offset.y, offset.z * std::cos(a) - offset.x * std::sin(a));
+		render(eye, image, zbuffer);
+		image.flip_vertically();
+		ok = raw ? image.write_raw(out) : image.write_ppm(out);
+	}
+	ok = fflush(out) == 0 && ok;
+	if (out != stdout) fclose(out);
+	if (!ok) std::cerr << "can't write the frames" << std::endl;
+	return ok ? 0 : 1;
+}
+
 int main(int argc, char** argv) 
 {
+	if (argc >= 2 && !strcmp(argv[1], "bench")) return run_bench(argc - 2, argv + 2);
+	if (argc >= 2 && !strcmp(argv[1], "optimize")) return run_optimize(argc - 2, argv + 2);
+	bool stream = argc >= 2 && !strcmp(argv[1], "stream");
+	if (stream && (argc < 3 || (strcmp(argv[2], "ppm") && strcmp(argv[2], "raw")))) {
+		std::cerr << "usage: stream <ppm|raw> [frames] [fd]" << std::endl;
+		return 1;
+	}
+
 	model = new Model("obj/african_head.obj");
+	std::cerr << "# model memory " << model->memory_usage() / 1024 << " KB" << std::endl;
 
-	lookat(camera, center, up);
-	projection(-1.f / (camera - center).norm());
-	viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
 	light_dir.normalize();
+	if (stream) {
+		int ret = stream_frames(argc - 2, argv + 2);
+		delete model;
+		return ret;
+	}
 
 	TGAImage image(width, height, TGAImage::RGB);
-	TGAImage zbuffer(width, height, TGAImage::GRAYSCALE);
+	DepthBuffer zbuffer(width, height, DepthBuffer::FLOAT32);
+	render(camera, image, zbuffer);
+	std::cerr << "# vertex shader runs " << Stats.vertices << " ACMR " << (double)Stats.vertices / std::max(1ll, (long long)Stats.faces) << std::endl;
+	std::cerr << "# faces " << Stats.faces << " culled facing " << Stats.culled_facing << " frustum " << Stats.culled_frustum << std::endl;
+	std::cerr << "# fragments " << Stats.fragments << " hiz culled triangles " << Stats.hiz_triangles << " tiles " << Stats.hiz_tiles << std::endl;
 
-	PhongShader shader;
-	for (int i = 0; i < model->nfaces(); i++)
-	{
-		Vec4f screen_coords[3];
-		for (int j = 0; j < 3; j++)
-		{
-			screen_coords[j] = shader.vertex(i, j);
-		}
-		triangle(screen_coords, shader, image, zbuffer);
+	image.flip_vertically();
+	// "SoftRenderer ppm": output.ppm and the unrounded depths in zbuffer.pfm instead of the tga files
+	if (argc >= 2 && !strcmp(argv[1], "ppm")) {
+		bool ok = image.write_ppm_file("output.ppm") & zbuffer.write_pfm_file("zbuffer.pfm");
+		delete model;
+		return ok ? 0 : 1;
 	}
 
-	image.flip_vertically();
-	zbuffer.flip_vertically();
-	image.write_tga_file("output.tga");
-	zbuffer.write_tga_file("zbuffer.tga");
+	// output.tga is encoded and written while the depth image is converted
+	ImageWriter writer;
+	std::future<bool> written = writer.write(image, "output.tga");
+	TGAImage zimage = zbuffer.to_tga();
+	zimage.flip_vertically();
+	std::future<bool> zwritten = writer.write(zimage, "zbuffer.tga");
 
 	delete model;
-	return 0;
+	bool ok = written.get() & zwritten.get();
+	return ok ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+MappedFile::MappedFile() : data_(NULL), size_(0)
+#ifdef _WIN32
+    , file_(INVALID_HANDLE_VALUE), mapping_(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char *filename) {
+    close();
+    file_ = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_==INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart==0) {
+        close();
+        return false;
+    }
+    mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_) data_ = (const unsigned char *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (!data_) {
+        close();
+        return false;
+    }
+    size_ = (size_t)size.QuadPart;
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_!=INVALID_HANDLE_VALUE) CloseHandle(file_);
+    data_ = NULL;
+    size_ = 0;
+    mapping_ = NULL;
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+bool file_stamp(const char *filename, uint64_t &size, int64_t &mtime) {
+    struct _stat64 st;
+    if (_stat64(filename, &st)) return false;
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+#else
+
+bool MappedFile::open(const char *filename) {
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd<0) return false;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size==0) {
+        ::close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file referenced
+    if (p==MAP_FAILED) return false;
+    data_ = (const unsigned char *)p;
+    size_ = (size_t)st.st_size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_) munmap((void *)data_, size_);
+    data_ = NULL;
+    size_ = 0;
+}
+
+bool file_stamp(const char *filename, uint64_t &size, int64_t &mtime) {
+    struct stat st;
+    if (stat(filename, &st)) return false;
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+#endif
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i=0; i<size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t hash_file(const char *filename) {
+    MappedFile f;
+    if (!f.open(filename)) return hash_bytes(NULL, 0);
+    return hash_bytes(f.data(), f.size());
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// read-only memory mapping of a whole file
+class MappedFile {
+protected:
+    const unsigned char *data_;
+    size_t size_;
+#ifdef _WIN32
+    void *file_;
+    void *mapping_;
+#endif
+public:
+    MappedFile();
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator =(const MappedFile &) = delete;
+
+    bool open(const char *filename);
+    void close();
+    const unsigned char *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool is_open() const { return data_!=NULL; }
+};
+
+// size and modification time of a file, false when it does not exist
+bool file_stamp(const char *filename, uint64_t &size, int64_t &mtime);
+// 64-bit FNV-1a
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h=14695981039346656037ull);
+uint64_t hash_file(const char *filename);
@@ -0,0 +1,261 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "mesh_opt.h"
+#include "model.h"
+#include "our_gl.h"
+
+float acmr_fifo(const int *indices, int nfaces, int cache_size) {
+    if (nfaces<=0) return 0.f;
+    std::vector<int> fifo(cache_size, -1);
+    int head = 0;
+    long long misses = 0;
+    for (int i=0; i<nfaces*3; i++) {
+        if (std::find(fifo.begin(), fifo.end(), indices[i])!=fifo.end()) continue;
+        fifo[head] = indices[i];
+        head = (head+1)%cache_size;
+        misses++;
+    }
+    return (float)misses/nfaces;
+}
+
+void optimize_vertex_cache(const int *indices, int nfaces, int nverts, int cache_size,
+                           std::vector<int> &order, std::vector<int> &clusters) {
+    // faces around each vertex, compressed rows
+    std::vector<int> start(nverts+1, 0), adjacency(nfaces*3);
+    for (int i=0; i<nfaces*3; i++) start[indices[i]+1]++;
+    for (int v=0; v<nverts; v++) start[v+1] += start[v];
+    std::vector<int> fill(start.begin(), start.end()-1);
+    for (int i=0; i<nfaces*3; i++) adjacency[fill[indices[i]]++] = i/3;
+
+    std::vector<int> live(nverts);  // faces not emitted yet
+    for (int v=0; v<nverts; v++) live[v] = start[v+1]-start[v];
+    std::vector<int> stamp(nverts, 0);
+    std::vector<char> emitted(nfaces, 0);
+    std::vector<int> dead_end;      // recently used vertices, the next fanning vertex when the candidates run out
+    std::vector<int> candidates;
+    int time = cache_size+1, cursor = 0;
+    order.clear();
+    clusters.clear();
+    int fan = nverts ? 0 : -1;
+    bool jumped = true;
+    while (fan>=0) {
+        candidates.clear();
+        for (int a=start[fan]; a<start[fan+1]; a++) {
+            int f = adjacency[a];
+            if (emitted[f]) continue;
+            if (jumped) {
+                clusters.push_back((int)order.size());
+                jumped = false;
+            }
+            order.push_back(f);
+            emitted[f] = 1;
+            for (int j=0; j<3; j++) {
+                int v = indices[f*3+j];
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time-stamp[v]>cache_size) stamp[v] = time++;
+            }
+        }
+        // prefer the candidate that is still in the cache and stays there while its remaining faces are emitted
+        int next = -1, best = -1;
+        for (size_t c=0; c<candidates.size(); c++) {
+            int v = candidates[c];
+            if (live[v]<=0) continue;
+            int priority = time-stamp[v]+2*live[v]<=cache_size ? time-stamp[v] : 0;
+            if (priority>best) {
+                best = priority;
+                next = v;
+            }
+        }
+        if (next<0) {
+            jumped = true;
+            while (!dead_end.empty() && next<0) {
+                int v = dead_end.back();
+                dead_end.pop_back();
+                if (live[v]>0) next = v;
+            }
+            while (next<0 && cursor<nverts) {
+                if (live[cursor]>0) next = cursor;
+                cursor++;
+            }
+        }
+        fan = next;
+    }
+}
+
+// splits every cluster where the ACMR of the part since the last split, simulated from a cold cache,
+// has fallen to threshold: these splits cost about as many extra misses as the finished part saved
+static std::vector<int> split_clusters(const int *indices, const std::vector<int> &order, const std::vector<int> &clusters,
+                                       int cache_size, float threshold) {
+    std::vector<int> result;
+    std::vector<int> fifo(cache_size);
+    for (size_t c=0; c<clusters.size(); c++) {
+        int end = c+1<clusters.size() ? clusters[c+1] : (int)order.size();
+        int first = clusters[c], misses = 0, head = 0;
+        std::fill(fifo.begin(), fifo.end(), -1);
+        result.push_back(first);
+        for (int i=first; i<end; i++) {
+            for (int j=0; j<3; j++) {
+                int v = indices[order[i]*3+j];
+                if (std::find(fifo.begin(), fifo.end(), v)!=fifo.end()) continue;
+                fifo[head] = v;
+                head = (head+1)%cache_size;
+                misses++;
+            }
+            if (i+1<end && misses<=threshold*(i+1-first)) {
+                result.push_back(i+1);
+                first = i+1;
+                misses = 0;
+                std::fill(fifo.begin(), fifo.end(), -1);
+            }
+        }
+    }
+    return result;
+}
+
+void optimize_overdraw(const int *indices, int nfaces, const std::vector<Vec3f> &positions, int cache_size, float threshold,
+                       std::vector<int> &order, const std::vector<int> &tipsify_clusters) {
+    if (tipsify_clusters.empty()) return;
+    std::vector<int> clusters = split_clusters(indices, order, tipsify_clusters, cache_size, threshold);
+    Vec3f mesh_center(0, 0, 0);
+    float mesh_area = 0.f;
+    int nclusters = (int)clusters.size();
+    std::vector<Vec3f> center(nclusters), normal(nclusters);
+    for (int c=0; c<nclusters; c++) {
+        int end = c+1<nclusters ? clusters[c+1] : (int)order.size();
+        Vec3f sum(0, 0, 0), n(0, 0, 0);
+        float area = 0.f;
+        for (int i=clusters[c]; i<end; i++) {
+            const int *t = indices + order[i]*3;
+            Vec3f a = positions[t[0]], b = positions[t[1]], d = positions[t[2]];
+            Vec3f cr = cross(b-a, d-a);
+            float w = cr.norm()*.5f;
+            sum = sum + (a+b+d)*(w/3.f);
+            n = n + cr;
+            area += w;
+        }
+        center[c] = area>0 ? sum*(1.f/area) : positions[indices[order[clusters[c]]*3]];
+        normal[c] = n;
+        mesh_center = mesh_center + sum;
+        mesh_area += area;
+    }
+    if (mesh_area>0) mesh_center = mesh_center*(1.f/mesh_area);
+
+    std::vector<float> key(nclusters);
+    std::vector<int> sorted(nclusters);
+    for (int c=0; c<nclusters; c++) {
+        float len = normal[c].norm();
+        key[c] = len>0 ? (center[c]-mesh_center)*normal[c]*(1.f/len) : 0.f;
+        sorted[c] = c;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [&](int a, int b) { return key[a]>key[b]; });
+    std::vector<int> result;
+    result.reserve(order.size());
+    for (int k=0; k<nclusters; k++) {
+        int c = sorted[k];
+        int end = c+1<nclusters ? clusters[c+1] : (int)order.size();
+        result.insert(result.end(), order.begin()+clusters[c], order.begin()+end);
+    }
+    order.swap(result);
+}
+
+void optimize_face_order(const int *indices, int nfaces, const std::vector<Vec3f> &positions, int cache_size,
+                         float threshold, std::vector<int> &order) {
+    std::vector<int> clusters;
+    optimize_vertex_cache(indices, nfaces, (int)positions.size(), cache_size, order, clusters);
+    optimize_overdraw(indices, nfaces, positions, cache_size, threshold, order, clusters);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// white fragments, counts how often each pixel is shaded through Stats.fragments
+struct CoverageShader final : public IShader {
+    const Model *mesh;
+
+    CoverageShader(const Model *m) : mesh(m) {}
+    virtual Vec4f vertex(int iface, int nthvert) { return uniforms.mvp * embed<4>(mesh->vertex(mesh->indices()[iface*3+nthvert]).pos); }
+    virtual bool fragment(Vec3f bar, TGAColor &color) { color = TGAColor(255, 255, 255); return false; }
+    virtual IShader *clone() const { return new CoverageShader(*this); }
+    virtual int nvaryings() const { return 1; }
+    virtual Vec4f shade_vertex(int ivert, float *varyings) const { varyings[0] = 0.f; return uniforms.mvp * embed<4>(mesh->vertex(ivert).pos); }
+    virtual void load_varyings(const float *v0, const float *v1, const float *v2) {}
+    virtual bool save_varyings(float *v0, float *v1, float *v2) const { *v0 = *v1 = *v2 = 0.f; return true; }
+};
+
+// shaded fragments per covered pixel, averaged over six views along the axes
+static float measure_overdraw(const Model &m) {
+    const int size = 512;
+    Vec3f lo( 1e30f,  1e30f,  1e30f), hi(-1e30f, -1e30f, -1e30f);
+    for (int i=0; i<m.nvertices(); i++)
+        for (int k=0; k<3; k++) {
+            lo[k] = std::min(lo[k], m.vertex(i).pos[k]);
+            hi[k] = std::max(hi[k], m.vertex(i).pos[k]);
+        }
+    Vec3f center = (lo+hi)*.5f;
+    float radius = std::max(1e-6f, (hi-lo).norm()*.5f);
+    Vec3f dirs[6] = { Vec3f(1,0,0), Vec3f(-1,0,0), Vec3f(0,1,0), Vec3f(0,-1,0), Vec3f(0,0,1), Vec3f(0,0,-1) };
+    double fragments = 0, covered = 0;
+    for (int d=0; d<6; d++) {
+        Vec3f up = d<2 || d>=4 ? Vec3f(0,1,0) : Vec3f(0,0,1);
+        Vec3f eye = center + dirs[d]*(radius*3.f);
+        lookat(eye, center, up);
+        // the bounding sphere to the unit sphere, the eye ends up at distance 3
+        Matrix scale = Matrix::identity();
+        for (int k=0; k<3; k++) scale[k][k] = 1.f/radius;
+        ModelView = scale*ModelView;
+        projection(-1.f/3.f);
+        viewport(size/8, size/8, size*3/4, size*3/4);
+
+        TGAImage image(size, size, TGAImage::GRAYSCALE);
+        DepthBuffer zbuffer(size, size);
+        CoverageShader shader(&m);
+        long long before = Stats.fragments;
+        draw_indexed(m.nfaces(), m.indices(), m.nvertices(), shader, image, zbuffer);
+        fragments += Stats.fragments-before;
+        for (int i=0; i<size*size; i++) covered += image.buffer()[i]!=0;
+    }
+    return covered>0 ? (float)(fragments/covered) : 0.f;
+}
+
+static float report(const char *label, const Model &m) {
+    float overdraw = measure_overdraw(m);
+    printf("  %-9s ACMR fifo16 %.3f  fifo32 %.3f  overdraw %.3f\n", label,
+           acmr_fifo(m.indices(), m.nfaces(), 16), acmr_fifo(m.indices(), m.nfaces(), 32), overdraw);
+    return overdraw;
+}
+
+int run_optimize(int argc, char **argv) {
+    if (argc<1) {
+        std::cerr << "usage: optimize <in.obj> [out.obj]" << std::endl;
+        return 1;
+    }
+    Model m(argv[0], false);
+    if (!m.nfaces()) return 1;
+    printf("%s: %d triangles, %d vertices\n", argv[0], m.nfaces(), m.nvertices());
+    report("before", m);
+
+    std::vector<Vec3f> positions(m.nvertices());
+    for (int i=0; i<m.nvertices(); i++) positions[i] = m.vertex(i).pos;
+    std::vector<int> order, clusters;
+    optimize_vertex_cache(m.indices(), m.nfaces(), m.nvertices(), Pipeline.vertex_cache_size, order, clusters);
+    m.reorder_faces(order);
+    float cache_only = report("tipsify", m);
+
+    // the cluster sort is a heuristic, it is kept only when the measured overdraw does not get worse
+    for (int i=0; i<m.nfaces(); i++) order[i] = i;
+    optimize_overdraw(m.indices(), m.nfaces(), positions, Pipeline.vertex_cache_size, .75f, order, clusters);
+    m.reorder_faces(order);
+    if (report("overdraw", m)>cache_only) {
+        std::vector<int> inverse(order.size());
+        for (size_t i=0; i<order.size(); i++) inverse[order[i]] = (int)i;
+        m.reorder_faces(inverse);
+        printf("  keeping the tipsify order\n");
+    }
+
+    bool ok = argc>=2 ? m.write_obj(argv[1]) : m.save_cache();
+    if (argc>=2) std::cerr << "obj file " << argv[1] << " writing " << (ok ? "ok" : "failed") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+
+// triangle order optimization for indexed meshes (indices: 3 per face into a vertex buffer)
+// after Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"
+
+// average cache misses per triangle of a FIFO post-transform cache, the same policy as VCACHE_FIFO
+float acmr_fifo(const int *indices, int nfaces, int cache_size);
+
+// Tipsify: returns the new face order, order[i] is the old index of face i,
+// and the first face of every cluster (a run that starts at a dead end) in clusters
+void optimize_vertex_cache(const int *indices, int nfaces, int nverts, int cache_size,
+                           std::vector<int> &order, std::vector<int> &clusters);
+
+// sorts the clusters of a vertex cache optimized order so that outward facing ones at the rim of the mesh,
+// the likely occluders, are drawn first; triangles keep their order inside a cluster.
+// clusters are first split where their cold cache ACMR has fallen to threshold,
+// lower values keep more of the cache locality, higher ones give finer clusters and less overdraw
+void optimize_overdraw(const int *indices, int nfaces, const std::vector<Vec3f> &positions, int cache_size, float threshold,
+                       std::vector<int> &order, const std::vector<int> &clusters);
+
+// both passes, order[i] is the old index of face i
+void optimize_face_order(const int *indices, int nfaces, const std::vector<Vec3f> &positions, int cache_size,
+                         float threshold, std::vector<int> &order);
+
+// "SoftRenderer optimize <in.obj> [out.obj]": reorders the faces, prints ACMR and overdraw before and after,
+// writes out.obj or, without it, the mesh cache of in.obj
+int run_optimize(int argc, char **argv);
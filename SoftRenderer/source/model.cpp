@@ -1,47 +1,268 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <cstdio>
+#include <cstring>
 #include "model.h"
+#include "obj_loader.h"
 
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
-            Vec3f v;
-            for (int i=0;i<3;i++) iss >> v[i];
-            verts_.push_back(v);
-        } else if (!line.compare(0, 3, "vn ")) {
-            iss >> trash >> trash;
-            Vec3f n;
-            for (int i=0;i<3;i++) iss >> n[i];
-            norms_.push_back(n);
-        } else if (!line.compare(0, 3, "vt ")) {
-            iss >> trash >> trash;
-            Vec2f uv;
-            for (int i=0;i<2;i++) iss >> uv[i];
-            uv_.push_back(uv);
-        }  else if (!line.compare(0, 2, "f ")) {
-            std::vector<Vec3i> f;
-            Vec3i tmp;
-            iss >> trash;
-            while (iss >> tmp[0] >> trash >> tmp[1] >> trash >> tmp[2]) {
-                for (int i=0; i<3; i++) tmp[i]--; // in wavefront obj all indices start at 1, not zero
-                f.push_back(tmp);
-            }
-            faces_.push_back(f);
+// layout of a .srmesh file: this header, then the arrays at 64-byte aligned offsets,
+// all in the byte order and float format of the machine that wrote it
+const char     SRMESH_MAGIC[8] = { 'S', 'R', 'M', 'E', 'S', 'H', 0, 0 };
+const uint32_t SRMESH_VERSION  = 5;
+const uint32_t SRMESH_ENDIAN   = 0x01020304;
+
+enum { SOURCE_OBJ, SOURCE_DIFFUSE, SOURCE_NM, SOURCE_SPEC, NSOURCES };
+enum { ARRAY_VERTS, ARRAY_UV, ARRAY_NORMS, ARRAY_CORNERS, ARRAY_VERTICES, ARRAY_INDICES, ARRAY_DIFFUSE, ARRAY_NM, ARRAY_SPEC, NARRAYS };
+
+struct SourceStamp {
+    uint64_t size;
+    int64_t  mtime;
+    uint64_t hash;   // FNV-1a of the contents, checked when only the mtime changed
+    uint32_t exists;
+    uint32_t pad;
+};
+
+struct MeshCacheHeader {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    endian;
+    uint64_t    file_size;
+    SourceStamp sources[NSOURCES];
+    uint64_t    count[NARRAYS];   // elements, bytes for the textures (MipPyramid::data(), the tiled mip pyramid)
+    uint64_t    offset[NARRAYS];
+    int32_t     tex_width[3];
+    int32_t     tex_height[3];
+    int32_t     tex_bytespp[3];   // 0 for the normal map, its texels are Vec3f
+    uint32_t    pad;
+};
+
+static const size_t array_elem_size[NARRAYS] = { sizeof(Vec3f), sizeof(Vec2f), sizeof(Vec3f), sizeof(Vec3i), sizeof(MeshVertex), sizeof(int), 1, 1, 1 };
+
+// <filename without extension><suffix>, empty when filename has no extension
+static std::string sibling_file(const std::string &filename, const char *suffix) {
+    size_t dot = filename.find_last_of(".");
+    if (dot==std::string::npos) return std::string();
+    return filename.substr(0,dot) + std::string(suffix);
+}
+
+static SourceStamp stamp_source(const std::string &filename, bool with_hash) {
+    SourceStamp st;
+    memset(&st, 0, sizeof(st));
+    st.exists = !filename.empty() && file_stamp(filename.c_str(), st.size, st.mtime);
+    if (st.exists && with_hash) st.hash = hash_file(filename.c_str());
+    return st;
+}
+
+Model::Model(const char *filename, bool use_cache) : cache_(), filename_(filename), verts_(), corners_(), norms_(), uv_(), vertices_(), indices_(), diffusemap_(), normalmap_(), specularmap_() {
+    std::string sources[NSOURCES] = { filename, sibling_file(filename, "_diffuse.tga"), sibling_file(filename, "_nm.tga"), sibling_file(filename, "_spec.tga") };
+    std::string cache = sibling_file(filename, ".srmesh");
+    if (use_cache && !cache.empty() && load_cache(cache, sources)) {
+        std::cerr << "# v# " << verts_.size() << " f# "  << nfaces() << " vt# " << uv_.size() << " vn# " << norms_.size() << " unique# " << vertices_.size() << " (mesh cache " << cache << ")" << std::endl;
+        return;
+    }
+
+    ObjData data;
+    if (!load_obj(filename, data)) {
+        std::cerr << "can't open file " << filename << std::endl;
+        return;
+    }
+    verts_.assign(data.verts);
+    corners_.assign(data.corners);
+    norms_.assign(data.norms);
+    uv_.assign(data.uv);
+    build_vertex_buffer();
+    std::cerr << "# v# " << verts_.size() << " f# "  << nfaces() << " vt# " << uv_.size() << " vn# " << norms_.size() << " unique# " << vertices_.size() << std::endl;
+    TGAImage img;
+    if (load_texture(filename, "_diffuse.tga", img)) diffusemap_.assign(img);
+    if (load_texture(filename, "_nm.tga",      img)) normalmap_.assign(img);
+    if (load_texture(filename, "_spec.tga",    img)) specularmap_.assign(img);
+    if (use_cache && !cache.empty()) write_cache(cache, sources);
+}
+
+// merges the corners with the same (v,vt,vn) into one vertex,
+// the candidates for a corner are chained per position index so no hash table is needed
+// vertices without vn get the area weighted sum of their faces' normals
+void Model::build_vertex_buffer() {
+    std::vector<MeshVertex> vertices;
+    std::vector<Vec3i> keys;
+    std::vector<int> indices(corners_.size());
+    std::vector<int> first(verts_.size(), -1), next;
+    for (size_t i=0; i<corners_.size(); i++) {
+        const Vec3i &c = corners_[i];
+        int v = first[c[0]];
+        while (v>=0 && !(keys[v][1]==c[1] && keys[v][2]==c[2])) v = next[v];
+        if (v<0) {
+            v = (int)vertices.size();
+            MeshVertex mv;
+            mv.pos = verts_[c[0]];
+            mv.uv = c[1]<0 ? Vec2f(0, 0) : uv_[c[1]];
+            mv.normal = c[2]<0 ? Vec3f(0, 0, 0) : norms_[c[2]];
+            if (c[2]>=0) mv.normal.normalize();
+            vertices.push_back(mv);
+            keys.push_back(c);
+            next.push_back(first[c[0]]);
+            first[c[0]] = v;
         }
+        indices[i] = v;
+    }
+    bool missing = false;
+    for (size_t i=0; i<corners_.size(); i+=3) {
+        if (corners_[i][2]>=0 && corners_[i+1][2]>=0 && corners_[i+2][2]>=0) continue;
+        Vec3f a = verts_[corners_[i][0]], b = verts_[corners_[i+1][0]], c = verts_[corners_[i+2][0]];
+        Vec3f n = cross(b-a, c-a);
+        for (int j=0; j<3; j++)
+            if (corners_[i+j][2]<0) vertices[indices[i+j]].normal = vertices[indices[i+j]].normal + n;
+        missing = true;
+    }
+    if (missing)
+        for (size_t i=0; i<vertices.size(); i++)
+            if (keys[i][2]<0 && vertices[i].normal.norm()>0) vertices[i].normal.normalize();
+    vertices_.assign(vertices);
+    indices_.assign(indices);
+}
+
+bool Model::load_cache(const std::string &path, const std::string *sources) {
+    if (!cache_.open(path.c_str())) return false;
+    const unsigned char *base = cache_.data();
+    MeshCacheHeader h;
+    bool valid = cache_.size()>=sizeof(h);
+    if (valid) {
+        memcpy(&h, base, sizeof(h));
+        valid = !memcmp(h.magic, SRMESH_MAGIC, sizeof(h.magic)) && h.version==SRMESH_VERSION && h.endian==SRMESH_ENDIAN && h.file_size==cache_.size();
+    }
+    for (int i=0; valid && i<NARRAYS; i++)
+        valid = h.offset[i]%alignof(Vec3f)==0 && h.offset[i]<=h.file_size && h.count[i]<=(h.file_size-h.offset[i])/array_elem_size[i];
+    valid = valid && h.count[ARRAY_CORNERS]%3==0 && h.count[ARRAY_INDICES]==h.count[ARRAY_CORNERS];
+    // the sources must be unchanged: same size, and the same mtime or else the same contents
+    for (int i=0; valid && i<NSOURCES; i++) {
+        SourceStamp now = stamp_source(sources[i], false);
+        const SourceStamp &then = h.sources[i];
+        valid = now.exists==then.exists;
+        if (valid && now.exists) valid = now.size==then.size && (now.mtime==then.mtime || hash_file(sources[i].c_str())==then.hash);
     }
-    std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
-    load_texture(filename, "_diffuse.tga", diffusemap_);
-    load_texture(filename, "_nm.tga",      normalmap_);
-    load_texture(filename, "_spec.tga",    specularmap_);
+    // the textures are used in place as well, view() checks the stored size against the dimensions;
+    // a stored texture that does not match them makes the whole cache invalid, the caller parses the sources again
+    if (valid && !diffusemap_.view(h.tex_width[0], h.tex_height[0], h.tex_bytespp[0], base+h.offset[ARRAY_DIFFUSE], (size_t)h.count[ARRAY_DIFFUSE]))
+        valid = !h.count[ARRAY_DIFFUSE];
+    if (valid && !normalmap_.view(h.tex_width[1], h.tex_height[1], base+h.offset[ARRAY_NM], (size_t)h.count[ARRAY_NM]))
+        valid = !h.count[ARRAY_NM];
+    if (valid && !specularmap_.view(h.tex_width[2], h.tex_height[2], h.tex_bytespp[2], base+h.offset[ARRAY_SPEC], (size_t)h.count[ARRAY_SPEC]))
+        valid = !h.count[ARRAY_SPEC];
+    if (!valid) {
+        // drop the views into the mapping before it goes away
+        diffusemap_.view(0, 0, 1, NULL, 0);
+        normalmap_.view(0, 0, NULL, 0);
+        specularmap_.view(0, 0, 1, NULL, 0);
+        cache_.close();
+        return false;
+    }
+
+    verts_.view((const Vec3f *)(base+h.offset[ARRAY_VERTS]), (size_t)h.count[ARRAY_VERTS]);
+    uv_.view((const Vec2f *)(base+h.offset[ARRAY_UV]), (size_t)h.count[ARRAY_UV]);
+    norms_.view((const Vec3f *)(base+h.offset[ARRAY_NORMS]), (size_t)h.count[ARRAY_NORMS]);
+    corners_.view((const Vec3i *)(base+h.offset[ARRAY_CORNERS]), (size_t)h.count[ARRAY_CORNERS]);
+    vertices_.view((const MeshVertex *)(base+h.offset[ARRAY_VERTICES]), (size_t)h.count[ARRAY_VERTICES]);
+    indices_.view((const int *)(base+h.offset[ARRAY_INDICES]), (size_t)h.count[ARRAY_INDICES]);
+    return true;
+}
+
+bool Model::write_cache(const std::string &path, const std::string *sources) {
+    MeshCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SRMESH_MAGIC, sizeof(h.magic));
+    h.version = SRMESH_VERSION;
+    h.endian  = SRMESH_ENDIAN;
+    for (int i=0; i<NSOURCES; i++) h.sources[i] = stamp_source(sources[i], true);
+
+    const void *arrays[NARRAYS] = { verts_.data(), uv_.data(), norms_.data(), corners_.data(), vertices_.data(), indices_.data(),
+                                    diffusemap_.data(), normalmap_.data(), specularmap_.data() };
+    h.count[ARRAY_VERTS]      = verts_.size();
+    h.count[ARRAY_UV]         = uv_.size();
+    h.count[ARRAY_NORMS]      = norms_.size();
+    h.count[ARRAY_CORNERS]    = corners_.size();
+    h.count[ARRAY_VERTICES]   = vertices_.size();
+    h.count[ARRAY_INDICES]    = indices_.size();
+    h.count[ARRAY_DIFFUSE]    = diffusemap_.bytes();
+    h.count[ARRAY_NM]         = normalmap_.bytes();
+    h.count[ARRAY_SPEC]       = specularmap_.bytes();
+    h.tex_width[0] = diffusemap_.width();
+    h.tex_width[1] = normalmap_.width();
+    h.tex_width[2] = specularmap_.width();
+    h.tex_height[0] = diffusemap_.height();
+    h.tex_height[1] = normalmap_.height();
+    h.tex_height[2] = specularmap_.height();
+    h.tex_bytespp[0] = diffusemap_.bytespp();
+    h.tex_bytespp[2] = specularmap_.bytespp();
+    uint64_t offset = sizeof(h);
+    for (int i=0; i<NARRAYS; i++) {
+        offset = (offset+63)/64*64;
+        h.offset[i] = offset;
+        offset += h.count[i]*array_elem_size[i];
+    }
+    h.file_size = offset;
+
+    // write next to the final name and rename, a reader never sees a half written cache
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    bool ok = f!=NULL;
+    if (ok) {
+        static const char zeros[64] = {};
+        ok = fwrite(&h, sizeof(h), 1, f)==1;
+        uint64_t pos = sizeof(h);
+        for (int i=0; ok && i<NARRAYS; i++) {
+            size_t gap = (size_t)(h.offset[i]-pos);
+            ok = fwrite(zeros, 1, gap, f)==gap;
+            size_t bytes = (size_t)h.count[i]*array_elem_size[i];
+            if (ok && bytes) ok = fwrite(arrays[i], 1, bytes, f)==bytes;
+            pos = h.offset[i]+bytes;
+        }
+        ok = fclose(f)==0 && ok;
+    }
+    if (ok) {
+        remove(path.c_str());
+        ok = rename(tmp.c_str(), path.c_str())==0;
+    }
+    if (!ok) remove(tmp.c_str());
+    std::cerr << "mesh cache " << path << " writing " << (ok ? "ok" : "failed") << std::endl;
+    return ok;
+}
+
+bool Model::save_cache() {
+    std::string sources[NSOURCES] = { filename_, sibling_file(filename_, "_diffuse.tga"), sibling_file(filename_, "_nm.tga"), sibling_file(filename_, "_spec.tga") };
+    std::string cache = sibling_file(filename_, ".srmesh");
+    return !cache.empty() && write_cache(cache, sources);
+}
+
+void Model::reorder_faces(const std::vector<int> &order) {
+    std::vector<Vec3i> corners(order.size()*3);
+    std::vector<int> indices(order.size()*3);
+    for (size_t i=0; i<order.size(); i++) {
+        for (int j=0; j<3; j++) {
+            corners[i*3+j] = corners_[order[i]*3+j];
+            indices[i*3+j] = indices_[order[i]*3+j];
+        }
+    }
+    corners_.assign(corners);
+    indices_.assign(indices);
+}
+
+bool Model::write_obj(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) return false;
+    for (size_t i=0; i<verts_.size(); i++) fprintf(f, "v %.9g %.9g %.9g\n", verts_[i].x, verts_[i].y, verts_[i].z);
+    for (size_t i=0; i<uv_.size(); i++)    fprintf(f, "vt %.9g %.9g\n", uv_[i].x, uv_[i].y);
+    for (size_t i=0; i<norms_.size(); i++) fprintf(f, "vn %.9g %.9g %.9g\n", norms_[i].x, norms_[i].y, norms_[i].z);
+    for (size_t i=0; i<corners_.size(); i+=3) {
+        fputc('f', f);
+        for (int j=0; j<3; j++) {
+            const Vec3i &c = corners_[i+j];
+            fprintf(f, " %d", c[0]+1);
+            if (c[1]>=0 || c[2]>=0) fputc('/', f);
+            if (c[1]>=0) fprintf(f, "%d", c[1]+1);
+            if (c[2]>=0) fprintf(f, "/%d", c[2]+1);
+        }
+        fputc('\n', f);
+    }
+    return fclose(f)==0;
 }
 
 Model::~Model() {}
@@ -50,14 +271,14 @@ int Model::nverts() {
     return (int)verts_.size();
 }
 
-int Model::nfaces() {
-    return (int)faces_.size();
+int Model::nfaces() const {
+    return (int)corners_.size()/3;
 }
 
-std::vector<int> Model::face(int idx) {
-    std::vector<int> face;
-    for (int i=0; i<(int)faces_[idx].size(); i++) face.push_back(faces_[idx][i][0]);
-    return face;
+size_t Model::memory_usage() {
+    size_t bytes = verts_.size()*sizeof(Vec3f) + uv_.size()*sizeof(Vec2f) + norms_.size()*sizeof(Vec3f) + corners_.size()*sizeof(Vec3i)
+                 + vertices_.size()*sizeof(MeshVertex) + indices_.size()*sizeof(int);
+    return bytes + diffusemap_.bytes() + normalmap_.bytes() + specularmap_.bytes();
 }
 
 Vec3f Model::vert(int i) {
@@ -65,44 +286,42 @@ Vec3f Model::vert(int i) {
 }
 
 Vec3f Model::vert(int iface, int nthvert) {
-    return verts_[faces_[iface][nthvert][0]];
+    return verts_[corner(iface, nthvert)[0]];
 }
 
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
-    std::string texfile(filename);
-    size_t dot = texfile.find_last_of(".");
-    if (dot!=std::string::npos) {
-        texfile = texfile.substr(0,dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-        img.flip_vertically();
-    }
+bool Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
+    std::string texfile = sibling_file(filename, suffix);
+    if (texfile.empty()) return false;
+    bool ok = img.read_tga_file(texfile.c_str());
+    std::cerr << "texture file " << texfile << " loading " << (ok ? "ok" : "failed") << std::endl;
+    img.flip_vertically();
+    return ok;
 }
 
-TGAColor Model::diffuse(Vec2f uvf) {
-    Vec2i uv(uvf[0]*diffusemap_.get_width(), uvf[1]*diffusemap_.get_height());
-    return diffusemap_.get(uv[0], uv[1]);
+TGAColor Model::diffuse(Vec2f uvf, float lod, TextureFilter filter) {
+    return diffusemap_.sample(uvf, lod, filter);
 }
 
-Vec3f Model::normal(Vec2f uvf) {
-    Vec2i uv(uvf[0]*normalmap_.get_width(), uvf[1]*normalmap_.get_height());
-    TGAColor c = normalmap_.get(uv[0], uv[1]);
-    Vec3f res;
-    for (int i=0; i<3; i++)
-        res[2-i] = (float)c[i]/255.f*2.f - 1.f;
-    return res;
+Vec3f Model::normal(Vec2f uvf, float lod, TextureFilter filter) {
+    return normalmap_.sample(uvf, lod, filter);
 }
 
 Vec2f Model::uv(int iface, int nthvert) {
-    return uv_[faces_[iface][nthvert][1]];
+    int idx = corner(iface, nthvert)[1];
+    return idx<0 ? Vec2f(0, 0) : uv_[idx];
 }
 
-float Model::specular(Vec2f uvf) {
-    Vec2i uv(uvf[0]*specularmap_.get_width(), uvf[1]*specularmap_.get_height());
-    return specularmap_.get(uv[0], uv[1])[0]/1.f;
+float Model::specular(Vec2f uvf, float lod, TextureFilter filter) {
+    return specularmap_.sample(uvf, lod, filter)[0]/1.f;
 }
 
 Vec3f Model::normal(int iface, int nthvert) {
-    int idx = faces_[iface][nthvert][2];
-    return norms_[idx].normalize();
+    int idx = corner(iface, nthvert)[2];
+    if (idx<0) { // no vn in the file, fall back to the face normal
+        Vec3f a = vert(iface, 0), b = vert(iface, 1), c = vert(iface, 2);
+        return cross(b-a, c-a).normalize();
+    }
+    Vec3f n = norms_[idx]; // normalize a copy, shaders may run on several threads
+    return n.normalize();
 }
 
@@ -4,30 +4,84 @@
 #include <string>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+#include "mapped_file.h"
+
+// read-only array that either owns its elements or views memory owned elsewhere (the mesh cache mapping)
+template <class T> class MeshArray {
+    std::vector<T> owned_;
+    const T *data_;
+    size_t size_;
+public:
+    MeshArray() : owned_(), data_(NULL), size_(0) {}
+    MeshArray(const MeshArray &) = delete;
+    MeshArray &operator =(const MeshArray &) = delete;
+
+    void assign(std::vector<T> &v) { owned_.swap(v); data_ = owned_.data(); size_ = owned_.size(); }
+    void view(const T *p, size_t n) { std::vector<T>().swap(owned_); data_ = p; size_ = n; }
+    const T &operator[](size_t i) const { return data_[i]; }
+    const T *data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+// one unique (v,vt,vn) combination of the obj file, normal is unit length
+struct MeshVertex {
+    Vec3f pos;
+    Vec2f uv;
+    Vec3f normal;
+};
+
+// the three corners of a triangle, points into the model's index buffer
+struct FaceView {
+    const Vec3i *corners; // this Vec3i means vertex/uv/normal
+    int size() const { return 3; }
+    int operator[](int i) const { return corners[i][0]; } // vertex index, like the old std::vector<int> face
+};
 
 class Model {
 private:
-    std::vector<Vec3f> verts_;
-    std::vector<std::vector<Vec3i> > faces_; // attention, this Vec3i means vertex/uv/normal
-    std::vector<Vec3f> norms_;
-    std::vector<Vec2f> uv_;
-    TGAImage diffusemap_;
-    TGAImage normalmap_;
-    TGAImage specularmap_;
-    void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    MappedFile cache_; // the arrays below may point into it, declared first so it is unmapped last
+    std::string filename_;
+    MeshArray<Vec3f> verts_;
+    MeshArray<Vec3i> corners_; // triangle list, face i uses corners_[3*i..3*i+2], this Vec3i means vertex/uv/normal
+    MeshArray<Vec3f> norms_;
+    MeshArray<Vec2f> uv_;
+    MeshArray<MeshVertex> vertices_; // deduplicated corners, indexed by indices_
+    MeshArray<int>        indices_;  // 3 per face, parallel to corners_
+    Texture diffusemap_;
+    NormalMap normalmap_;
+    Texture specularmap_;
+    bool load_texture(std::string filename, const char *suffix, TGAImage &img);
+    bool load_cache(const std::string &path, const std::string *sources);
+    bool write_cache(const std::string &path, const std::string *sources);
+    const Vec3i &corner(int iface, int nthvert) const { return corners_[iface*3+nthvert]; }
+    void build_vertex_buffer();
 public:
-    Model(const char *filename);
+    // use_cache: map <name>.srmesh when it matches the obj and textures, otherwise parse them and write it
+    Model(const char *filename, bool use_cache=true);
     ~Model();
+    Model(const Model &) = delete;
+    Model &operator =(const Model &) = delete;
     int nverts();
-    int nfaces();
+    int nfaces() const;
     Vec3f normal(int iface, int nthvert);
-    Vec3f normal(Vec2f uv);
+    // texture lookups, lod is uv_lod() of the pixel's uv derivatives and filter usually the draw's Uniforms::texture_filter;
+    // normal(uv) comes from the decoded float map, no per-sample byte decode
+    Vec3f normal(Vec2f uv, float lod, TextureFilter filter);
     Vec3f vert(int i);
     Vec3f vert(int iface, int nthvert);
     Vec2f uv(int iface, int nthvert);
-    TGAColor diffuse(Vec2f uv);
-    float specular(Vec2f uv);
-    std::vector<int> face(int idx);
-};
-
+    TGAColor diffuse(Vec2f uv, float lod, TextureFilter filter);
+    float specular(Vec2f uv, float lod, TextureFilter filter);
+    FaceView face(int idx) const { FaceView f = { &corners_[idx*3] }; return f; }
+    // indexed vertex buffer: every (v,vt,vn) triplet stored once, faces reference it through indices()
+    int nvertices() const { return (int)vertices_.size(); }
+    const MeshVertex &vertex(int i) const { return vertices_[i]; }
+    const int *indices() const { return indices_.data(); }
+    size_t memory_usage(); // bytes held by the mesh arrays and textures, including their mip levels
 
+    // face i of the result is face order[i] of the current model
+    void reorder_faces(const std::vector<int> &order);
+    bool write_obj(const char *filename); // v, vt, vn in their original order, faces as triangles
+    bool save_cache();                    // rewrites <name>.srmesh from the current arrays
+};
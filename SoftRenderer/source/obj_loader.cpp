@@ -0,0 +1,247 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <charconv>
+#include <thread>
+#include <algorithm>
+#include "obj_loader.h"
+#include "mapped_file.h"
+
+bool read_file(const char *filename, std::vector<char> &buffer) {
+    // ftell returns a 32-bit long on Windows, the 64-bit stat size holds files over 2 GB
+    uint64_t size;
+    int64_t mtime;
+    if (!file_stamp(filename, size, mtime) || size>(uint64_t)SIZE_MAX) return false;
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false;
+    buffer.resize((size_t)size);
+    bool ok = fread(buffer.data(), 1, buffer.size(), f)==buffer.size();
+    fclose(f);
+    return ok;
+}
+
+static inline const char *skip_blanks(const char *p, const char *end) {
+    while (p<end && (*p==' ' || *p=='\t' || *p=='\r')) p++;
+    return p;
+}
+
+static inline const char *parse_float(const char *p, const char *end, float &v) {
+    p = skip_blanks(p, end);
+    if (p<end && *p=='+') p++; // from_chars does not accept a leading plus
+    std::from_chars_result r = std::from_chars(p, end, v);
+    if (r.ec!=std::errc()) v = 0.f;
+    return r.ptr;
+}
+
+static inline const char *parse_int(const char *p, const char *end, int &v, bool &ok) {
+    if (p<end && *p=='+') p++;
+    std::from_chars_result r = std::from_chars(p, end, v);
+    ok = r.ec==std::errc();
+    return r.ptr;
+}
+
+// 1-based or negative (counted back from the last element read so far) index to 0-based, -1 when invalid
+static inline int resolve_index(int idx, int count) {
+    if (idx>0) return idx-1;
+    if (idx<0) return count+idx;
+    return -1;
+}
+
+// relative==NULL resolves negative indices against data directly,
+// otherwise against the elements of this range only and records corners[i][k] as 3*i+k for a later fix up
+static void parse_obj_range(const char *begin, const char *end, ObjData &data, std::vector<size_t> *relative) {
+    std::vector<Vec3i> poly;   // corners of the current polygon
+    std::vector<int> poly_rel; // bit k set when poly[i][k] was a negative index
+    for (const char *p = begin; p<end; ) {
+        const char *eol = p;
+        while (eol<end && *eol!='\n') eol++;
+        p = skip_blanks(p, eol);
+        if (eol-p>=2 && p[0]=='v' && (p[1]==' ' || p[1]=='\t')) {
+            Vec3f v;
+            p += 2;
+            for (int i=0; i<3; i++) p = parse_float(p, eol, v[i]);
+            data.verts.push_back(v);
+        } else if (eol-p>=3 && p[0]=='v' && p[1]=='n' && (p[2]==' ' || p[2]=='\t')) {
+            Vec3f n;
+            p += 3;
+            for (int i=0; i<3; i++) p = parse_float(p, eol, n[i]);
+            data.norms.push_back(n);
+        } else if (eol-p>=3 && p[0]=='v' && p[1]=='t' && (p[2]==' ' || p[2]=='\t')) {
+            Vec2f uv;
+            p += 3;
+            for (int i=0; i<2; i++) p = parse_float(p, eol, uv[i]);
+            data.uv.push_back(uv);
+        } else if (eol-p>=2 && p[0]=='f' && (p[1]==' ' || p[1]=='\t')) {
+            int counts[3] = { (int)data.verts.size(), (int)data.uv.size(), (int)data.norms.size() };
+            poly.clear();
+            poly_rel.clear();
+            p += 2;
+            while ((p = skip_blanks(p, eol)) < eol) {
+                // v, v/vt, v//vn or v/vt/vn
+                Vec3i corner(-1, -1, -1);
+                int rel = 0;
+                bool has_vert = false;
+                for (int k=0; k<3; k++) {
+                    int idx;
+                    bool ok;
+                    p = parse_int(p, eol, idx, ok);
+                    if (ok) corner[k] = resolve_index(idx, counts[k]);
+                    if (ok && idx<0) rel |= 1<<k;
+                    if (k==0) has_vert = ok && idx!=0;
+                    if (p>=eol || *p!='/') break;
+                    p++;
+                }
+                if (!has_vert) break;
+                poly.push_back(corner);
+                poly_rel.push_back(rel);
+                while (p<eol && *p!=' ' && *p!='\t' && *p!='\r') p++;
+            }
+            // triangle fan around the first corner, polygons with less than 3 corners are dropped
+            for (int i=1; i+1<(int)poly.size(); i++) {
+                int tri[3] = { 0, i, i+1 };
+                for (int j=0; j<3; j++) {
+                    if (relative)
+                        for (int k=0; k<3; k++)
+                            if (poly_rel[tri[j]]>>k&1) relative->push_back(data.corners.size()*3+k);
+                    data.corners.push_back(poly[tri[j]]);
+                }
+            }
+        }
+        p = eol+1;
+    }
+}
+
+// texture and normal indices out of range become -1, triangles with a vertex index out of range are dropped
+static void check_indices(ObjData &data) {
+    int counts[3] = { (int)data.verts.size(), (int)data.uv.size(), (int)data.norms.size() };
+    size_t n = 0;
+    for (size_t i=0; i<data.corners.size(); i+=3) {
+        bool keep = true;
+        for (int j=0; j<3; j++) {
+            Vec3i &c = data.corners[i+j];
+            keep = keep && c[0]>=0 && c[0]<counts[0];
+            for (int k=1; k<3; k++)
+                if (c[k]>=counts[k] || c[k]<-1) c[k] = -1;
+        }
+        if (!keep) continue;
+        for (int j=0; j<3; j++) data.corners[n+j] = data.corners[i+j];
+        n += 3;
+    }
+    data.corners.resize(n);
+}
+
+bool parse_obj(const char *begin, const char *end, ObjData &data) {
+    parse_obj_range(begin, end, data, NULL);
+    check_indices(data);
+    return true;
+}
+
+bool parse_obj_parallel(const char *begin, const char *end, ObjData &data, int threads) {
+    if (threads<=0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+    threads = (int)std::min<size_t>(threads, (end-begin)/OBJ_MIN_CHUNK+1);
+    if (threads<=1) return parse_obj(begin, end, data);
+
+    // chunk boundaries right after a newline, so that no record is split
+    std::vector<const char*> bounds(threads+1, end);
+    bounds[0] = begin;
+    for (int i=1; i<threads; i++) {
+        const char *p = std::max(bounds[i-1], begin+(end-begin)*i/threads);
+        while (p<end && p[-1]!='\n') p++;
+        bounds[i] = p;
+    }
+
+    std::vector<ObjData> chunks(threads);
+    std::vector<std::vector<size_t> > relative(threads);
+    std::vector<std::thread> pool;
+    for (int i=1; i<threads; i++)
+        pool.push_back(std::thread(parse_obj_range, bounds[i], bounds[i+1], std::ref(chunks[i]), &relative[i]));
+    parse_obj_range(bounds[0], bounds[1], chunks[0], &relative[0]);
+    for (size_t i=0; i<pool.size(); i++) pool[i].join();
+
+    // prefix sums of the element counts give each chunk's offset, appending in chunk order keeps the serial layout
+    int base[3] = { (int)data.verts.size(), (int)data.uv.size(), (int)data.norms.size() };
+    size_t totals[4] = { data.verts.size(), data.uv.size(), data.norms.size(), data.corners.size() };
+    for (int i=0; i<threads; i++) {
+        totals[0] += chunks[i].verts.size();
+        totals[1] += chunks[i].uv.size();
+        totals[2] += chunks[i].norms.size();
+        totals[3] += chunks[i].corners.size();
+    }
+    data.verts.reserve(totals[0]);
+    data.uv.reserve(totals[1]);
+    data.norms.reserve(totals[2]);
+    data.corners.reserve(totals[3]);
+    for (int i=0; i<threads; i++) {
+        ObjData &c = chunks[i];
+        for (size_t j=0; j<relative[i].size(); j++) {
+            size_t r = relative[i][j];
+            c.corners[r/3][(int)(r%3)] += base[r%3];
+        }
+        data.verts.insert(data.verts.end(), c.verts.begin(), c.verts.end());
+        data.uv.insert(data.uv.end(), c.uv.begin(), c.uv.end());
+        data.norms.insert(data.norms.end(), c.norms.begin(), c.norms.end());
+        data.corners.insert(data.corners.end(), c.corners.begin(), c.corners.end());
+        base[0] += (int)c.verts.size();
+        base[1] += (int)c.uv.size();
+        base[2] += (int)c.norms.size();
+        c = ObjData();
+    }
+    check_indices(data);
+    return true;
+}
+
+bool load_obj(const char *filename, ObjData &data, int threads) {
+    // the records are parsed straight from the mapping, without a copy of the whole file
+    MappedFile file;
+    if (!file.open(filename)) {
+        uint64_t size;
+        int64_t mtime;
+        return file_stamp(filename, size, mtime) && size==0; // an empty file cannot be mapped but is a valid empty model
+    }
+    const char *begin = (const char *)file.data();
+    return parse_obj_parallel(begin, begin+file.size(), data, threads);
+}
+
+bool load_obj_legacy(const char *filename, ObjData &data) {
+    std::ifstream in;
+    in.open (filename, std::ifstream::in);
+    if (in.fail()) return false;
+    std::string line;
+    while (!in.eof()) {
+        std::getline(in, line);
+        std::istringstream iss(line.c_str());
+        char trash;
+        if (!line.compare(0, 2, "v ")) {
+            iss >> trash;
+            Vec3f v;
+            for (int i=0;i<3;i++) iss >> v[i];
+            data.verts.push_back(v);
+        } else if (!line.compare(0, 3, "vn ")) {
+            iss >> trash >> trash;
+            Vec3f n;
+            for (int i=0;i<3;i++) iss >> n[i];
+            data.norms.push_back(n);
+        } else if (!line.compare(0, 3, "vt ")) {
+            iss >> trash >> trash;
+            Vec2f uv;
+            for (int i=0;i<2;i++) iss >> uv[i];
+            data.uv.push_back(uv);
+        }  else if (!line.compare(0, 2, "f ")) {
+            std::vector<Vec3i> f;
+            Vec3i tmp;
+            iss >> trash;
+            while (iss >> tmp[0] >> trash >> tmp[1] >> trash >> tmp[2]) {
+                for (int i=0; i<3; i++) tmp[i]--; // in wavefront obj all indices start at 1, not zero
+                f.push_back(tmp);
+            }
+            for (int i=1; i+1<(int)f.size(); i++) {
+                data.corners.push_back(f[0]);
+                data.corners.push_back(f[i]);
+                data.corners.push_back(f[i+1]);
+            }
+        }
+    }
+    return true;
+}
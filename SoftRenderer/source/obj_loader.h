@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+
+// contents of a wavefront obj file, all indices are 0-based
+// polygons are split into triangle fans, a corner without a (valid) texture or normal index stores -1 there
+struct ObjData {
+    std::vector<Vec3f> verts;
+    std::vector<Vec3f> norms;
+    std::vector<Vec2f> uv;
+    std::vector<Vec3i> corners; // 3 per triangle, attention, this Vec3i means vertex/uv/normal
+};
+
+const size_t OBJ_MIN_CHUNK = 1<<20; // smaller files are not worth a thread per chunk
+
+// reads the whole file into one buffer and tokenizes it with std::from_chars,
+// understands v, v/vt, v//vn, v/vt/vn and negative (relative) indices
+// threads: 0 = std::thread::hardware_concurrency(), 1 = serial; the result does not depend on it
+bool load_obj(const char *filename, ObjData &data, int threads=0);
+bool parse_obj(const char *begin, const char *end, ObjData &data);
+// splits the text into newline aligned chunks parsed on separate threads,
+// then appends them in order and shifts the negative indices by the counts of the preceding chunks
+bool parse_obj_parallel(const char *begin, const char *end, ObjData &data, int threads=0);
+
+// the original getline + istringstream parser, kept as a reference for benchmarks,
+// handles v/vt/vn faces only
+bool load_obj_legacy(const char *filename, ObjData &data);
+
+bool read_file(const char *filename, std::vector<char> &buffer);
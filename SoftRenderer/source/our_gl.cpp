@@ -2,22 +2,76 @@
 #include <limits>
 #include <cstdlib>
 #include "our_gl.h"
+#include "rasterizer.h"
 #include <algorithm>
+#include <vector>
+#include <thread>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 Matrix ModelView;
 Matrix Viewport;
 Matrix Projection;
 
+PipelineState Pipeline = { 0, RASTER_EDGE, CULL_BACK, cpu_simd_level()>=FLOAT8_LEVEL, true, false, VCACHE_PREPASS, 32, 0, 0, 0, 0, FILTER_TRILINEAR };
+RenderStats Stats;
+
 IShader::~IShader() {}
 
+int IShader::fragment8(const FragmentBatch &in, ColorBatch &out) {
+    int written = 0;
+    TGAColor color;
+    for (int k=0; k<8; k++) {
+        if (!(in.mask>>k&1)) continue;
+        if (fragment(Vec3f(in.bar[0][k], in.bar[1][k], in.bar[2][k]), color)) continue;
+        memcpy(out.bgra[k], color.bgra, 4);
+        written |= 1<<k;
+    }
+    return written;
+}
+
+//CPUֵָ֧float8ɫܷ
+SimdLevel cpu_simd_level() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2]>>27)&1;
+    bool avx     = (info[2]>>28)&1;
+    if (osxsave && avx && (_xgetbv(0)&6)==6) return SIMD_AVX;
+    return (info[3]>>26)&1 ? SIMD_SSE2 : SIMD_SCALAR;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))  return SIMD_AVX;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+    return SIMD_SCALAR;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
 //ӽǾ
 void viewport(int x, int y, int w, int h) {
     Viewport = Matrix::identity();
     Viewport[0][3] = x+w/2.f;
     Viewport[1][3] = y+h/2.f;
-    Viewport[2][3] = 255.f/2.f;
+    Viewport[2][3] = DEPTH_MAX/2.f;
     Viewport[0][0] = w/2.f;
     Viewport[1][1] = h/2.f;
-    Viewport[2][2] = 255.f/2.f;
+    Viewport[2][2] = DEPTH_MAX/2.f;
+}
+
+//ǰÿλƵĳ
+Uniforms current_uniforms() {
+    Uniforms u;
+    u.model_view = ModelView;
+    u.projection = Projection;
+    u.viewport   = Viewport;
+    u.mvp        = Viewport*Projection*ModelView;
+    u.proj_mv    = Projection*ModelView;
+    u.mv_it      = ModelView.invert_transpose();
+    u.texture_filter = Pipeline.texture_filter;
+    return u;
 }
 
 //ͶӰ
@@ -59,45 +113,80 @@ Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P) {
     return Vec3f(-1,1,1);
 }
 
+//û߳0ʾʹȫӲ߳
+void set_threads(int n) {
+    Pipeline.threads = std::max(0, n);
+}
+
+void set_raster_mode(RasterMode mode) {
+    Pipeline.raster_mode = mode;
+}
+
+void set_batch_shading(bool enable) {
+    Pipeline.batch_shading = enable && cpu_simd_level()>=FLOAT8_LEVEL;
+}
+
+void set_hiz(bool enable) {
+    Pipeline.hiz = enable;
+}
+
+void set_depth_prepass(bool enable) {
+    Pipeline.depth_prepass = enable;
+}
+
+void set_cull_mode(CullMode mode) {
+    Pipeline.cull_mode = mode;
+}
+
+void set_vertex_cache(VertexCacheMode mode, int size) {
+    Pipeline.vertex_cache = mode;
+    Pipeline.vertex_cache_size = std::max(3, size);
+}
+
+void set_scissor(int x, int y, int w, int h) {
+    Pipeline.scissor_x = x;
+    Pipeline.scissor_y = y;
+    Pipeline.scissor_w = w;
+    Pipeline.scissor_h = h;
+}
+
+void set_texture_filter(TextureFilter filter) {
+    Pipeline.texture_filter = filter;
+}
+
+void reset_stats() {
+    Stats.hiz_triangles = 0;
+    Stats.hiz_tiles = 0;
+    Stats.fragments = 0;
+    Stats.vertices = 0;
+    Stats.faces = 0;
+    Stats.culled_frustum = 0;
+    Stats.culled_facing = 0;
+}
+
+int worker_count() {
+    return Pipeline.threads>0 ? Pipeline.threads : std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+//job(0)ڵִ߳Уִ߳УÿεöȴЩ߳̽ûгפ̳߳
+void run_workers(int nworkers, const std::function<void(int)> &job) {
+    std::vector<std::thread> pool;
+    for (int w=1; w<nworkers; w++) pool.push_back(std::thread(job, w));
+    job(0);
+    for (size_t w=0; w<pool.size(); w++) pool[w].join();
+}
+
 //
-void triangle(Vec4f *pts, IShader &shader, TGAImage &image, TGAImage &zbuffer) {
-    //ʼα߽
-    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    for (int i=0; i<3; i++) {
-        for (int j=0; j<2; j++) {
-            //ptsһʵ͸еţΪ߽
-            bboxmin[j] = std::min(bboxmin[j], pts[i][j]/pts[i][3]);
-            bboxmax[j] = std::max(bboxmax[j], pts[i][j]/pts[i][3]);
-        }
-    }
-    //ǰPɫcolor
-    Vec2i P;
-    TGAColor color;
-    //߽еÿһ
-    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
-        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
-            //cΪǰPӦ
-            //ptsһʵ͸еţжPǷ
-            Vec3f c = barycentric(proj<2>(pts[0]/pts[0][3]), proj<2>(pts[1]/pts[1][3]), proj<2>(pts[2]/pts[2][3]), proj<2>(P));
-            //ֵPzbuffer
-            //pts[i]Ϊε
-            //pts[i][2]ΪεzϢ(0~255)
-            //pts[i][3]ΪεͶӰϵ(1-z/c)
-            
-            float z_P = (pts[0][2]/ pts[0][3])*c.x + (pts[1][2] / pts[1][3]) *c.y + (pts[2][2] / pts[2][3]) *c.z;
-            int frag_depth = std::max(0, int(z_P+.5));
-            //PһķС0zbufferСzbufferȾ
-            if (c.x<0 || c.y<0 || c.z<0 || zbuffer.get(P.x, P.y)[0]>frag_depth) continue;
-            //ƬԪɫ㵱ǰɫ
-            bool discard = shader.fragment(c, color);
-            if (!discard) {
-                //zbuffer
-                zbuffer.set(P.x, P.y, TGAColor(frag_depth));
-                //Ϊɫ
-                image.set(P.x, P.y, color);
-            }
-        }
-    }
+void triangle(Vec4f *pts, IShader &shader, TGAImage &image, DepthBuffer &zbuffer) {
+    if (!cull_and_count(pts, image.get_width(), image.get_height())) return;
+    if (rasterize<IShader>(pts, shader, image, zbuffer, 0, 0, image.get_width(), image.get_height())) Stats.hiz_triangles++;
 }
 
+//ͨ麯ɫĻ
+void draw(int nfaces, IShader &shader, TGAImage &image, DepthBuffer &zbuffer) {
+    draw<IShader>(nfaces, shader, image, zbuffer);
+}
+
+void draw_indexed(int nfaces, const int *indices, int nverts, IShader &shader, TGAImage &image, DepthBuffer &zbuffer) {
+    draw_indexed<IShader>(nfaces, indices, nverts, shader, image, zbuffer);
+}
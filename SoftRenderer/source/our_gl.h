@@ -1,7 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include "tgaimage.h"
 #include "geometry.h"
+#include "depthbuffer.h"
+#include "simd.h"
+#include "texture.h"
 
 extern Matrix ModelView;
 extern Matrix Viewport;
@@ -11,12 +16,139 @@ void viewport(int x, int y, int w, int h);
 void projection(float coeff=0.f); // coeff = -1/c
 void lookat(Vec3f eye, Vec3f center, Vec3f up);
 
+// per-draw constants derived from the matrices above, computed once by draw() before any vertex()
+struct Uniforms {
+    Matrix model_view;
+    Matrix projection;
+    Matrix viewport;
+    Matrix mvp;        // Viewport*Projection*ModelView, object space to screen
+    Matrix proj_mv;    // Projection*ModelView
+    Matrix mv_it;      // ModelView.invert_transpose(), for normals
+    TextureFilter texture_filter; // Pipeline.texture_filter, passed to the Model texture lookups
+};
+
+Uniforms current_uniforms();
+
+// 8 horizontally adjacent fragments of one triangle, structure of arrays
+struct FragmentBatch {
+    float bar[3][8]; // barycentric coordinates, bar[k][lane]
+    int mask;        // lanes that are covered and passed the depth test
+};
+
+// packed colors written by IShader::fragment8(), one bgra quad per lane
+struct ColorBatch {
+    unsigned char bgra[8][4];
+
+    // truncates like the scalar float->unsigned char assignment, v must be in [0,255]
+    void set_channel(int ch, float8 v) {
+        float f[8];
+        v.store(f);
+        for (int i=8; i--; bgra[i][ch]=(unsigned char)f[i]);
+    }
+};
+
 struct IShader {
+    Uniforms uniforms;
+    // screen space derivatives of the barycentric coordinates, set by the rasterizer before the fragments
+    // of a triangle are shaded; interpolation is linear in screen space, so they hold for the whole triangle
+    // and varying_uv*bar_dx is the uv derivative a 2x2 quad would measure
+    Vec3f bar_dx, bar_dy;
+
     virtual ~IShader();
+    // called by draw() once per draw, before vertex() and before the shader is cloned;
+    // overrides compute their own per-draw constants after calling IShader::prepare()
+    virtual void prepare(const Uniforms &u) { uniforms = u; }
     virtual Vec4f vertex(int iface, int nthvert) = 0;
     virtual bool fragment(Vec3f bar, TGAColor &color) = 0;
+    // shades the lanes in in.mask and returns the lanes that were not discarded,
+    // the default forwards lane by lane to fragment()
+    virtual int fragment8(const FragmentBatch &in, ColorBatch &out);
+    // per-thread copy for the tiled draw(), NULL keeps draw() serial
+    virtual IShader *clone() const { return NULL; }
+
+    // draw_indexed() support: floats of varyings per vertex, 0 makes draw_indexed() fall back to draw()
+    virtual int nvaryings() const { return 0; }
+    // transforms vertex ivert of the vertex buffer and writes its varyings,
+    // called once per vertex and from several threads at once
+    virtual Vec4f shade_vertex(int ivert, float *varyings) const { return Vec4f(); }
+    // sets the varyings of the face about to be rasterized from its corners' shade_vertex() outputs
+    virtual void load_varyings(const float *v0, const float *v1, const float *v2) {}
+    // the inverse of load_varyings() after vertex(iface, 0..2): writes the corners' varyings so the tiled draw()
+    // keeps them from binning instead of running vertex() again for every tile the face overlaps.
+    // false (the default) when the shader cannot, draw() then re-runs vertex() per tile
+    virtual bool save_varyings(float *v0, float *v1, float *v2) const { return false; }
+};
+
+const int TILE_SIZE = 64;
+
+enum RasterMode {
+    RASTER_EDGE,   // incremental edge functions (default)
+    RASTER_COMPAT  // per-pixel barycentric(), bit-identical to the original rasterizer together with CULL_NONE and FILTER_NEAREST
+};
+
+enum CullMode {
+    CULL_NONE,
+    CULL_BACK,  // drops clockwise triangles (in the y-up space after viewport())
+    CULL_FRONT  // drops counter-clockwise triangles
+};
+
+// how draw_indexed() reuses transformed vertices
+enum VertexCacheMode {
+    VCACHE_PREPASS, // transform every vertex of the buffer once before rasterizing (default)
+    VCACHE_FIFO,    // post-transform FIFO of vertex_cache_size entries, filled in submission order before binning
+    VCACHE_NONE     // shade all three corners of every face
+};
+
+struct PipelineState {
+    int threads;
+    RasterMode raster_mode;
+    CullMode cull_mode;
+    bool batch_shading;
+    bool hiz;
+    bool depth_prepass;
+    VertexCacheMode vertex_cache;
+    int vertex_cache_size;
+    int scissor_x, scissor_y, scissor_w, scissor_h; // scissor_w or scissor_h <= 0 disables the scissor test
+    TextureFilter texture_filter; // copied into Uniforms for the shaders' texture lookups
+};
+
+// counters accumulated by triangle() and draw() until reset_stats()
+struct RenderStats {
+    std::atomic<long long> hiz_triangles; // triangles rejected as a whole by the hierarchical z test
+    std::atomic<long long> hiz_tiles;     // HIZ_TILE blocks skipped by the hierarchical z test
+    std::atomic<long long> fragments;     // fragment shader invocations
+    std::atomic<long long> vertices;       // vertex shader invocations, vertex() or shade_vertex(); ACMR = vertices/faces
+    std::atomic<long long> faces;          // triangles submitted
+    std::atomic<long long> culled_frustum; // triangles entirely outside the image or behind the camera
+    std::atomic<long long> culled_facing;  // triangles dropped by the cull mode (including zero area ones)
 };
 
-void triangle(Vec4f *pts, IShader &shader, TGAImage &image, TGAImage &zbuffer);
+extern PipelineState Pipeline;
+extern RenderStats Stats;
+
+void set_threads(int n); // 0 = std::thread::hardware_concurrency()
+void set_raster_mode(RasterMode mode);
+void set_cull_mode(CullMode mode);
+void set_batch_shading(bool enable); // ignored unless the cpu supports FLOAT8_LEVEL
+void set_hiz(bool enable);
+// draw() renders depth only first, then shades the pixels whose depth matches,
+// shaders that discard fragments must not use it
+void set_depth_prepass(bool enable);
+void set_vertex_cache(VertexCacheMode mode, int size=32);
+void set_scissor(int x, int y, int w, int h); // pixels outside are never touched, w=h=0 disables
+void set_texture_filter(TextureFilter filter);
+void reset_stats();
+int worker_count();
+void run_workers(int nworkers, const std::function<void(int)> &job);
+
+void triangle(Vec4f *pts, IShader &shader, TGAImage &image, DepthBuffer &zbuffer);
+void draw(int nfaces, IShader &shader, TGAImage &image, DepthBuffer &zbuffer);
+// indices: 3 per face into a vertex buffer of nverts vertices, each vertex is shaded once
+void draw_indexed(int nfaces, const int *indices, int nverts, IShader &shader, TGAImage &image, DepthBuffer &zbuffer);
+// instantiates the rasterizer for ShaderT, declare the shader final so its stages inline
+template <class ShaderT> void draw(int nfaces, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer);
+template <class ShaderT> void draw_indexed(int nfaces, const int *indices, int nverts, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer);
+
+#include "rasterizer.h"
 
 
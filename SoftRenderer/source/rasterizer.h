@@ -0,0 +1,651 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include "our_gl.h"
+
+//դģɫʵ
+//ShaderTΪIShaderʱ麯Ϊfinalľɫʱvertex()/fragment()
+
+Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P);
+
+//ν׶ΣȶĻԺ
+//ֻһݶȣֻ֮ӷ
+struct EdgeSetup {
+    Vec2f A, B, C;
+    float det;
+    Vec3f dcdx, dcdy; //xyƫ
+    Vec3f z;          //
+    const mat<3,3,float> *remap; //üΣε껻ԭΣΪNULL
+
+    //falseʾ˻жbarycentric()ͬ
+    bool init(Vec4f *pts, const mat<3,3,float> *bar_remap=NULL) {
+        remap = bar_remap;
+        A = proj<2>(pts[0]/pts[0][3]);
+        B = proj<2>(pts[1]/pts[1][3]);
+        C = proj<2>(pts[2]/pts[2][3]);
+        det = (C.x-A.x)*(B.y-A.y) - (B.x-A.x)*(C.y-A.y);
+        if (std::abs(det)<=1e-2) return false;
+        dcdx = Vec3f(0, -(C.y-A.y)/det,  (B.y-A.y)/det);
+        dcdy = Vec3f(0,  (C.x-A.x)/det, -(B.x-A.x)/det);
+        dcdx.x = -dcdx.y-dcdx.z;
+        dcdy.x = -dcdy.y-dcdy.z;
+        z = Vec3f(pts[0][2]/pts[0][3], pts[1][2]/pts[1][3], pts[2][2]/pts[2][3]);
+        return true;
+    }
+
+    //(x,y)
+    Vec3f at(float x, float y) const {
+        Vec3f c;
+        c.y = ((A.x-x)*(C.y-A.y) - (C.x-A.x)*(A.y-y))/det;
+        c.z = ((B.x-A.x)*(A.y-y) - (A.x-x)*(B.y-A.y))/det;
+        c.x = 1.f-c.y-c.z;
+        return c;
+    }
+};
+
+//ƵĽ׶
+enum RasterPass {
+    PASS_COLOR_DEPTH, //Ȳͨɫд
+    PASS_DEPTH_ONLY,  //ԤȾֻдȣfragment()
+    PASS_SHADE_EQUAL  //ɫ׶ΣֻɫԤȾȵأд
+};
+
+//ȲԣPASS_SHADE_EQUALʱҪ
+inline bool depth_pass(RasterPass pass, unsigned int stored, unsigned int frag_depth) {
+    return pass==PASS_SHADE_EQUAL ? stored==frag_depth : stored<=frag_depth;
+}
+
+//ڲѭֻ[xs,xe]x[ys,ye]䣩ڵأǷдȣshadedۼfragmentô
+
+template <class ShaderT> bool rasterize_edges(const EdgeSetup &e, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer, int xs, int ys, int xe, int ye, RasterPass pass, int &shaded) {
+    float dzdy = e.z*e.dcdy;
+    bool written = false;
+    Vec2i P;
+    TGAColor color;
+    for (P.x=xs; P.x<=xe; P.x++) {
+        //
+        Vec3f c = e.at(P.x, ys);
+        float z_P = e.z*c;
+        bool entered = false;
+        for (P.y=ys; P.y<=ye; P.y++, c=c+e.dcdy, z_P+=dzdy) {
+            //͹ģ뿪вٽ
+            if (c.x<0 || c.y<0 || c.z<0) {
+                if (entered) break;
+                continue;
+            }
+            entered = true;
+            unsigned int frag_depth = zbuffer.encode(z_P);
+            if (!depth_pass(pass, zbuffer.get_code(P.x, P.y), frag_depth)) continue;
+            if (pass==PASS_DEPTH_ONLY) {
+                zbuffer.set_code(P.x, P.y, frag_depth);
+                written = true;
+                continue;
+            }
+            shaded++;
+            bool discard = shader.fragment(e.remap ? (*e.remap)*c : c, color);
+            if (!discard) {
+                if (pass==PASS_COLOR_DEPTH) {
+                    zbuffer.set_code(P.x, P.y, frag_depth);
+                    written = true;
+                }
+                image.set(P.x, P.y, color);
+            }
+        }
+    }
+    return written;
+}
+
+//ɫÿȡ8أǺȲͨɣɫfragment8()
+template <class ShaderT> bool rasterize_edges8(const EdgeSetup &e, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer, int xs, int ys, int xe, int ye, RasterPass pass, int &shaded) {
+    float dzdx = e.z*e.dcdx;
+    bool written = false;
+    int width = image.get_width();
+    int bpp   = image.get_bytespp();
+    unsigned char *color_data = image.buffer();
+    FragmentBatch batch;
+    ColorBatch colors;
+    unsigned int frag_depth[8];
+    for (int y=ys; y<=ye; y++) {
+        unsigned int *depth_row = zbuffer.row(y);
+        bool entered = false;
+        for (int x=xs; x<=xe; x+=8) {
+            Vec3f c = e.at(x, y);
+            float z_P = e.z*c;
+            int covered = 0;
+            batch.mask = 0;
+            for (int k=0; k<8; k++, c=c+e.dcdx, z_P+=dzdx) {
+                batch.bar[0][k] = c.x;
+                batch.bar[1][k] = c.y;
+                batch.bar[2][k] = c.z;
+                if (x+k>xe || c.x<0 || c.y<0 || c.z<0) continue;
+                covered |= 1<<k;
+                frag_depth[k] = zbuffer.encode(z_P);
+                if (depth_pass(pass, depth_row[x+k], frag_depth[k])) batch.mask |= 1<<k;
+            }
+            //뿪вٽ
+            if (!covered) {
+                if (entered) break;
+                continue;
+            }
+            entered = true;
+            if (!batch.mask) continue;
+            if (pass==PASS_DEPTH_ONLY) {
+                for (int k=0; k<8; k++)
+                    if (batch.mask>>k&1) depth_row[x+k] = frag_depth[k];
+                written = true;
+                continue;
+            }
+            for (int k=0; k<8; k++) shaded += batch.mask>>k&1;
+            if (e.remap) {
+                for (int k=0; k<8; k++) {
+                    Vec3f bar = (*e.remap)*Vec3f(batch.bar[0][k], batch.bar[1][k], batch.bar[2][k]);
+                    for (int i=0; i<3; i++) batch.bar[i][k] = bar[i];
+                }
+            }
+            int kept = shader.fragment8(batch, colors);
+            for (int k=0; k<8; k++) {
+                if (!(kept>>k&1)) continue;
+                if (pass==PASS_COLOR_DEPTH) {
+                    depth_row[x+k] = frag_depth[k];
+                    written = true;
+                }
+                memcpy(color_data+(x+k+y*width)*bpp, colors.bgra[k], bpp);
+            }
+        }
+    }
+    return written;
+}
+
+//ģʽصbarycentric()ɰ汾λһ
+template <class ShaderT> bool rasterize_compat(Vec4f *pts, const mat<3,3,float> *remap, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer, int xs, int ys, int xe, int ye, RasterPass pass, int &shaded) {
+    bool written = false;
+    //ǰPɫcolor
+    Vec2i P;
+    TGAColor color;
+    //߽еÿһ
+    for (P.x=xs; P.x<=xe; P.x++) {
+        for (P.y=ys; P.y<=ye; P.y++) {
+            //cΪǰPӦ
+            //ptsһʵ͸еţжPǷ
+            Vec3f c = barycentric(proj<2>(pts[0]/pts[0][3]), proj<2>(pts[1]/pts[1][3]), proj<2>(pts[2]/pts[2][3]), proj<2>(P));
+            //ֵPzbuffer
+            //pts[i]Ϊε
+            //pts[i][2]ΪεzϢ(0~255)
+            //pts[i][3]ΪεͶӰϵ(1-z/c)
+            
+            float z_P = (pts[0][2]/ pts[0][3])*c.x + (pts[1][2] / pts[1][3]) *c.y + (pts[2][2] / pts[2][3]) *c.z;
+            //ݾɰ汾ȡ
+            unsigned int frag_depth = zbuffer.encode((float)std::max(0, int(z_P+.5)));
+            //PһķС0zbufferСzbufferȾ
+            if (c.x<0 || c.y<0 || c.z<0 || !depth_pass(pass, zbuffer.get_code(P.x, P.y), frag_depth)) continue;
+            if (pass==PASS_DEPTH_ONLY) {
+                zbuffer.set_code(P.x, P.y, frag_depth);
+                written = true;
+                continue;
+            }
+            //ƬԪɫ㵱ǰɫ
+            shaded++;
+            bool discard = shader.fragment(remap ? (*remap)*c : c, color);
+            if (!discard) {
+                //zbuffer
+                if (pass==PASS_COLOR_DEPTH) {
+                    zbuffer.set_code(P.x, P.y, frag_depth);
+                    written = true;
+                }
+                //Ϊɫ
+                image.set(P.x, P.y, color);
+            }
+        }
+    }
+    return written;
+}
+
+//դһѾڽƽͱڵΣֻ[x0,x1)x[y0,y1)Χڵ
+//ΧڵĲ޳ʱtrueɵ߰Stats.hiz_triangles
+template <class ShaderT> bool rasterize_triangle(Vec4f *pts, const mat<3,3,float> *remap, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer, int x0, int y0, int x1, int y1, RasterPass pass) {
+    //ʼα߽
+    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+    float zmax = -std::numeric_limits<float>::max();
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<2; j++) {
+            //ptsһʵ͸еţΪ߽
+            bboxmin[j] = std::min(bboxmin[j], pts[i][j]/pts[i][3]);
+            bboxmax[j] = std::max(bboxmax[j], pts[i][j]/pts[i][3]);
+        }
+        zmax = std::max(zmax, pts[i][2]/pts[i][3]);
+    }
+    //߽Χ󽻣ڸ²üԽת
+    bboxmin.x = std::max(bboxmin.x, (float)x0);
+    bboxmin.y = std::max(bboxmin.y, (float)y0);
+    bboxmax.x = std::min(bboxmax.x, (float)(x1-1));
+    bboxmax.y = std::min(bboxmax.y, (float)(y1-1));
+    if (!(bboxmin.x<=bboxmax.x && bboxmin.y<=bboxmax.y)) return false;
+    int xs = bboxmin.x, xe = (int)std::floor(bboxmax.x);
+    int ys = bboxmin.y, ye = (int)std::floor(bboxmax.y);
+
+    bool compat = Pipeline.raster_mode==RASTER_COMPAT;
+    bool direct = image.buffer() && zbuffer.get_width()==image.get_width() && zbuffer.get_height()==image.get_height();
+    bool batch  = !compat && Pipeline.batch_shading && direct;
+    EdgeSetup e;
+    bool setup = e.init(pts, remap);
+    if (!compat && !setup) return false;
+    //LODõ굼üλԭ
+    shader.bar_dx = setup ? (remap ? (*remap)*e.dcdx : e.dcdx) : Vec3f(0, 0, 0);
+    shader.bar_dy = setup ? (remap ? (*remap)*e.dcdy : e.dcdy) : Vec3f(0, 0, 0);
+
+    //ȣȱȿԶȻԶ鱻ڵ
+    //ֵõȿԴڶȣ֤޳Ǳص
+    bool hiz = Pipeline.hiz && zbuffer.get_width()==image.get_width() && zbuffer.get_height()==image.get_height();
+    unsigned int nearest = hiz ? zbuffer.encode(zmax + (compat ? .5f : 1e-3f)) : 0;
+    if (hiz) {
+        bool visible = false;
+        for (int ty=ys/DepthBuffer::HIZ_TILE2; !visible && ty<=ye/DepthBuffer::HIZ_TILE2; ty++)
+            for (int tx=xs/DepthBuffer::HIZ_TILE2; !visible && tx<=xe/DepthBuffer::HIZ_TILE2; tx++)
+                visible = zbuffer.hiz_min2(tx, ty)<=nearest;
+        if (!visible) return true;
+    }
+
+    //HIZ_TILEС߽򣬹رղʱ߽Ϊһ
+    int T = hiz ? DepthBuffer::HIZ_TILE : std::max(xe-xs, ye-ys)+1;
+    int nblocks = 0, culled = 0, shaded = 0;
+    for (int by=hiz ? ys-ys%T : ys; by<=ye; by+=T) {
+        for (int bx=hiz ? xs-xs%T : xs; bx<=xe; bx+=T) {
+            nblocks++;
+            if (hiz && zbuffer.hiz_min(bx/T, by/T)>nearest) {
+                culled++;
+                continue;
+            }
+            int bxs = std::max(bx, xs), bxe = std::min(bx+T-1, xe);
+            int bys = std::max(by, ys), bye = std::min(by+T-1, ye);
+            bool written;
+            if (compat)     written = rasterize_compat(pts, remap, shader, image, zbuffer, bxs, bys, bxe, bye, pass, shaded);
+            else if (batch) written = rasterize_edges8(e, shader, image, zbuffer, bxs, bys, bxe, bye, pass, shaded);
+            else            written = rasterize_edges(e, shader, image, zbuffer, bxs, bys, bxe, bye, pass, shaded);
+            if (hiz && written) zbuffer.hiz_touch(bx/T, by/T);
+        }
+    }
+    if (shaded) Stats.fragments += shaded;
+    if (culled) Stats.hiz_tiles += culled;
+    return hiz && culled==nblocks;
+}
+
+//βüռ䣨ӿڱ任ıwеSutherland-Hodgmanü
+//ƽ棺w>=W_NEARx/wy/wͼGUARD_BAND
+//ȫڱڵβüֻΧнضϵͼͼþ
+const float W_NEAR = 1e-3f;
+const float GUARD_BAND = 4096.f;
+const int CLIP_PLANES = 5;
+const int MAX_CLIP_VERTS = 3+CLIP_PLANES;
+
+//üεĶ㣺ԭε
+struct ClipVertex {
+    Vec4f pos;
+    Vec3f bar;
+};
+
+//kü룬Ǹʾڲ
+inline float clip_distance(int k, const Vec4f &v, int width, int height) {
+    switch (k) {
+        case 0:  return v[3]-W_NEAR;
+        case 1:  return v[0]+GUARD_BAND*v[3];
+        case 2:  return (width+GUARD_BAND)*v[3]-v[0];
+        case 3:  return v[1]+GUARD_BAND*v[3];
+        default: return (height+GUARD_BAND)*v[3]-v[1];
+    }
+}
+
+//ضζ0ʾȫĳü⣻clippedΪfalseʱpolyԭ
+inline int clip_triangle(Vec4f *pts, int width, int height, ClipVertex *poly, bool &clipped) {
+    int outside_all = (1<<CLIP_PLANES)-1, outside_any = 0;
+    for (int i=0; i<3; i++) {
+        int code = 0;
+        for (int k=0; k<CLIP_PLANES; k++)
+            if (!(clip_distance(k, pts[i], width, height)>=0)) code |= 1<<k;
+        outside_all &= code;
+        outside_any |= code;
+    }
+    clipped = false;
+    if (outside_all) return 0;
+    for (int i=0; i<3; i++) {
+        poly[i].pos = pts[i];
+        poly[i].bar = Vec3f(i==0, i==1, i==2);
+    }
+    if (!outside_any) return 3;
+
+    clipped = true;
+    int n = 3;
+    ClipVertex tmp[MAX_CLIP_VERTS];
+    for (int k=0; k<CLIP_PLANES && n; k++) {
+        if (!(outside_any>>k&1)) continue;
+        int m = 0;
+        for (int i=0; i<n; i++) {
+            const ClipVertex &a = poly[i], &b = poly[(i+1)%n];
+            float da = clip_distance(k, a.pos, width, height);
+            float db = clip_distance(k, b.pos, width, height);
+            if (da>=0) tmp[m++] = a;
+            if ((da>=0) != (db>=0)) {
+                float t = da/(da-db);
+                tmp[m].pos = a.pos + (b.pos-a.pos)*t;
+                tmp[m].bar = a.bar + (b.bar-a.bar)*t;
+                m++;
+            }
+        }
+        n = m;
+        for (int i=0; i<n; i++) poly[i] = tmp[i];
+    }
+    return n>=3 ? n : 0;
+}
+
+//դΣֻ[x0,x1)x[y0,y1)þཻΧڵ
+//üÿζ޳ʱtrue
+template <class ShaderT> bool rasterize(Vec4f *pts, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer, int x0, int y0, int x1, int y1, RasterPass pass=PASS_COLOR_DEPTH) {
+    if (Pipeline.scissor_w>0 && Pipeline.scissor_h>0) {
+        x0 = std::max(x0, Pipeline.scissor_x);
+        y0 = std::max(y0, Pipeline.scissor_y);
+        x1 = std::min(x1, Pipeline.scissor_x+Pipeline.scissor_w);
+        y1 = std::min(y1, Pipeline.scissor_y+Pipeline.scissor_h);
+        if (x0>=x1 || y0>=y1) return false;
+    }
+    ClipVertex poly[MAX_CLIP_VERTS];
+    bool clipped;
+    int n = clip_triangle(pts, image.get_width(), image.get_height(), poly, clipped);
+    if (!clipped) return n && rasterize_triangle(pts, (const mat<3,3,float>*)NULL, shader, image, zbuffer, x0, y0, x1, y1, pass);
+    //ü͹ΰβ
+    bool occluded = n>0;
+    for (int i=1; i+1<n; i++) {
+        Vec4f sub[3] = { poly[0].pos, poly[i].pos, poly[i+1].pos };
+        mat<3,3,float> remap;
+        remap.set_col(0, poly[0].bar);
+        remap.set_col(1, poly[i].bar);
+        remap.set_col(2, poly[i+1].bar);
+        occluded = rasterize_triangle(sub, &remap, shader, image, zbuffer, x0, y0, x1, y1, pass) && occluded;
+    }
+    return occluded;
+}
+
+//üĻΧУαȫ޳ʱfalse
+inline bool screen_bbox(Vec4f *pts, int width, int height, Vec2f &bboxmin, Vec2f &bboxmax) {
+    ClipVertex poly[MAX_CLIP_VERTS];
+    bool clipped;
+    int n = clip_triangle(pts, width, height, poly, clipped);
+    bboxmin = Vec2f( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+    bboxmax = Vec2f(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+    for (int i=0; i<n; i++) {
+        for (int k=0; k<2; k++) {
+            bboxmin[k] = std::min(bboxmin[k], poly[i].pos[k]/poly[i].pos[3]);
+            bboxmax[k] = std::max(bboxmax[k], poly[i].pos[k]/poly[i].pos[3]);
+        }
+    }
+    return n>0;
+}
+
+//޳ȫ׶ͼΧͽƽ棩ĳΣԼ޳
+//(x,y,w)ʽжϣĻwĻʱҲ
+enum CullResult {
+    CULL_KEEP, CULL_FRUSTUM, CULL_FACING
+};
+
+inline CullResult cull_triangle(Vec4f *pts, int width, int height, CullMode mode) {
+    int outside_all = 15;
+    for (int i=0; i<3; i++) {
+        const Vec4f &v = pts[i];
+        int code = 0;
+        if (!(v[3]>0.f))          code |= 1;
+        if (!(v[0]>=0.f))         code |= 2;
+        if (!(v[0]<=width*v[3]))  code |= 4;
+        if (!(v[1]>=0.f))         code |= 8;
+        if (!(v[1]<=height*v[3])) code |= 16;
+        outside_all &= code;
+    }
+    //w<=0ʱxyıȽû壬ֻнƽ֮Ķĸж
+    if (outside_all & 1) return CULL_FRUSTUM;
+    if (outside_all & 30 && pts[0][3]>0.f && pts[1][3]>0.f && pts[2][3]>0.f) return CULL_FRUSTUM;
+    if (mode==CULL_NONE) return CULL_KEEP;
+    float area = pts[0][0]*(pts[1][1]*pts[2][3]-pts[2][1]*pts[1][3])
+               - pts[1][0]*(pts[0][1]*pts[2][3]-pts[2][1]*pts[0][3])
+               + pts[2][0]*(pts[0][1]*pts[1][3]-pts[1][1]*pts[0][3]);
+    //ʱ루ΪΪ棬Ϊ0ûأһ޳
+    if (mode==CULL_BACK  && !(area>0.f)) return CULL_FACING;
+    if (mode==CULL_FRONT && !(area<0.f)) return CULL_FACING;
+    return CULL_KEEP;
+}
+
+//޳Ҫդʱtrue
+inline bool cull_and_count(Vec4f *pts, int width, int height) {
+    Stats.faces++;
+    switch (cull_triangle(pts, width, height, Pipeline.cull_mode)) {
+        case CULL_FRUSTUM: Stats.culled_frustum++; return false;
+        case CULL_FACING:  Stats.culled_facing++;  return false;
+        default:           return true;
+    }
+}
+
+//ֿʱÿ̵߳ɫ
+template <class ShaderT> ShaderT *clone_shader(const ShaderT &shader) { return new ShaderT(shader); }
+inline IShader *clone_shader(const IShader &shader) { return shader.clone(); }
+
+//ֿ
+//ǰˣִ߳жɫĻΧаηֵTILE_SIZE x TILE_SIZEĿУ
+//ͬʱÿüռĶǵvarying
+//ˣÿ̳߳һɫȡ飬ȡĶvaryingύ˳դڵ
+//ÿֻдԼΧڵcolorzbuffer˲Ҫ봮лһ
+//ԤȾʱȶֻдȣֻȵɫÿɼֻɫһ
+//ֿʱ鶼ͬһɣҪ̼߳ͬ
+//fetch(shader, worker, iface, pts, vary)ȡһ㣺varyΪNULLʱѸvaryingŽshader
+//ǵvaryingÿshader.nvaryings()floatдvary޷ȡʱfalse
+//ȡvaryingɫûʵsave_varyings()ں˶ÿصĿ顢лʱɫһµfetch
+//ɫظִ
+//workerǵ̵߳ţǰ˷ֿʹлƶ0
+template <class ShaderT, class FetchT> void draw_faces(int nfaces, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer, FetchT fetch) {
+    int width  = image.get_width();
+    int height = image.get_height();
+    int workers = worker_count();
+    RasterPass passes[2] = { PASS_COLOR_DEPTH, PASS_COLOR_DEPTH };
+    int npasses = 1;
+    if (Pipeline.depth_prepass) {
+        passes[0] = PASS_DEPTH_ONLY;
+        passes[1] = PASS_SHADE_EQUAL;
+        npasses = 2;
+    }
+    ShaderT *probe = workers>1 ? clone_shader(shader) : NULL;
+    if (!probe) {
+        //̻߳ɫֿ֧л
+        //ԤȾʱһ鱣ͨ޳ĶvaryingɫһֱӶȡ׶κ޳ִֻһ
+        int nv = shader.nvaryings();
+        bool stored = npasses>1 && nv>0;
+        std::vector<int> faces;
+        std::vector<Vec4f> face_pts;
+        std::vector<float> face_vary, vary(3*nv);
+        for (int i=0; i<nfaces; i++) {
+            Vec4f pts[3];
+            if (stored) stored = fetch(shader, 0, i, pts, vary.data());
+            else fetch(shader, 0, i, pts, (float*)NULL);
+            if (!cull_and_count(pts, width, height)) continue;
+            //ֻдȵһ鲻fragment()Ҫָvarying
+            bool occluded = rasterize(pts, shader, image, zbuffer, 0, 0, width, height, passes[0]);
+            if (npasses==1) {
+                if (occluded) Stats.hiz_triangles++;
+                continue;
+            }
+            faces.push_back(i);
+            face_pts.insert(face_pts.end(), pts, pts+3);
+            if (stored) face_vary.insert(face_vary.end(), vary.begin(), vary.end());
+        }
+        //޳ɫһ
+        for (size_t k=0; k<faces.size(); k++) {
+            Vec4f pts[3];
+            if (stored) {
+                for (int j=0; j<3; j++) pts[j] = face_pts[k*3+j];
+                const float *v = &face_vary[k*3*nv];
+                shader.load_varyings(v, v+nv, v+2*nv);
+            } else {
+                fetch(shader, 0, faces[k], pts, (float*)NULL);
+            }
+            if (rasterize(pts, shader, image, zbuffer, 0, 0, width, height, passes[1])) Stats.hiz_triangles++;
+        }
+        return;
+    }
+
+    //ȲÿHIZ_TILE2ֻһ
+    static_assert(TILE_SIZE % DepthBuffer::HIZ_TILE2 == 0, "a hierarchical z square must not straddle two raster tiles");
+    int tiles_x = (width +TILE_SIZE-1)/TILE_SIZE;
+    int tiles_y = (height+TILE_SIZE-1)/TILE_SIZE;
+    //бǷֿţfaces[k]ύ˳е
+    std::vector<std::vector<int> > bins(tiles_x*tiles_y);
+    std::vector<int> faces;
+    int nv = shader.nvaryings();
+    bool stored = nv>0;
+    std::vector<Vec4f> face_pts;
+    std::vector<float> face_vary, vary(3*nv);
+    for (int i=0; i<nfaces; i++) {
+        Vec4f pts[3];
+        if (stored) stored = fetch(shader, 0, i, pts, vary.data());
+        else fetch(shader, 0, i, pts, (float*)NULL);
+        if (!cull_and_count(pts, width, height)) continue;
+        Vec2f bboxmin, bboxmax;
+        if (!screen_bbox(pts, width, height, bboxmin, bboxmax)) continue;
+        //ΧȫĻ⣨ΪNaNβκο
+        if (!(bboxmax.x>=0 && bboxmax.y>=0 && bboxmin.x<width && bboxmin.y<height)) continue;
+        int tx0 = (int)std::max(bboxmin.x, 0.f)/TILE_SIZE, tx1 = (int)std::min(bboxmax.x, (float)(width -1))/TILE_SIZE;
+        int ty0 = (int)std::max(bboxmin.y, 0.f)/TILE_SIZE, ty1 = (int)std::min(bboxmax.y, (float)(height-1))/TILE_SIZE;
+        int k = (int)faces.size();
+        faces.push_back(i);
+        face_pts.insert(face_pts.end(), pts, pts+3);
+        if (stored) face_vary.insert(face_vary.end(), vary.begin(), vary.end());
+        for (int ty=ty0; ty<=ty1; ty++)
+            for (int tx=tx0; tx<=tx1; tx++)
+                bins[tx+ty*tiles_x].push_back(k);
+    }
+
+    workers = std::min(workers, (int)bins.size());
+    std::vector<ShaderT*> shaders(workers, NULL);
+    shaders[0] = probe;
+    for (int w=1; w<workers; w++) shaders[w] = clone_shader(shader);
+
+    //һûаѸ޳ʱ1ֻ߳дֵͬ
+    std::vector<std::atomic<unsigned char> > visible(faces.size());
+    std::atomic<int> next_tile(0);
+    run_workers(workers, [&](int w) {
+        ShaderT *local = shaders[w];
+        for (int t; (t = next_tile++) < (int)bins.size(); ) {
+            int x0 = (t%tiles_x)*TILE_SIZE, y0 = (t/tiles_x)*TILE_SIZE;
+            int x1 = std::min(x0+TILE_SIZE, width), y1 = std::min(y0+TILE_SIZE, height);
+            for (int p=0; p<npasses; p++) {
+                for (int k : bins[t]) {
+                    Vec4f pts[3];
+                    if (stored) {
+                        for (int j=0; j<3; j++) pts[j] = face_pts[k*3+j];
+                        const float *v = &face_vary[(size_t)k*3*nv];
+                        local->load_varyings(v, v+nv, v+2*nv);
+                    } else {
+                        //ȡö㣬ָ߳ɫиvarying
+                        fetch(*local, w, faces[k], pts, (float*)NULL);
+                    }
+                    if (!rasterize(pts, *local, image, zbuffer, x0, y0, x1, y1, passes[p]) && p==npasses-1)
+                        visible[k].store(1, std::memory_order_relaxed);
+                }
+            }
+        }
+    });
+    for (int w=0; w<workers; w++) delete shaders[w];
+    //һֻһΣֻڵÿ鶼޳ʱż
+    long long occluded = 0;
+    for (size_t k=0; k<faces.size(); k++) occluded += !visible[k].load(std::memory_order_relaxed);
+    if (occluded) Stats.hiz_triangles += occluded;
+}
+
+//vertex()Ķᱻظ任
+template <class ShaderT> void draw(int nfaces, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer) {
+    shader.prepare(current_uniforms());
+    int nv = shader.nvaryings();
+    draw_faces(nfaces, shader, image, zbuffer, [nv](ShaderT &s, int, int iface, Vec4f *pts, float *vary) {
+        for (int j=0; j<3; j++) pts[j] = s.vertex(iface, j);
+        Stats.vertices += 3;
+        return !vary || s.save_varyings(vary, vary+nv, vary+2*nv);
+    });
+}
+
+//任󶥵FIFO棬Ųңüռλúvarying
+class VertexCache {
+    std::vector<int> tags;
+    std::vector<Vec4f> pos;
+    std::vector<float> vary;
+    int nv, head;
+public:
+    VertexCache(int size, int nvaryings) : tags(size, -1), pos(size), vary((size_t)size*nvaryings), nv(nvaryings), head(0) {}
+
+    //ضivertڵĲۣδʱִshade_vertex()滻Ĳ
+    template <class ShaderT> int fetch(const ShaderT &shader, int ivert, long long &misses) {
+        for (int i=0; i<(int)tags.size(); i++)
+            if (tags[i]==ivert) return i;
+        int slot = head;
+        head = (head+1)%(int)tags.size();
+        tags[slot] = ivert;
+        pos[slot] = shader.shade_vertex(ivert, &vary[(size_t)slot*nv]);
+        misses++;
+        return slot;
+    }
+    const Vec4f &position(int slot) const { return pos[slot]; }
+    const float *varyings(int slot) const { return &vary[(size_t)slot*nv]; }
+};
+
+//VCACHE_PREPASS׶ÿִֻһshade_vertex()̰߳˳ֶδդʱȡ
+//VCACHE_FIFOһVertexCacheڷֿ֮ǰύ˳ȡ㣬ֻȡľֲԣ߳޹
+//VCACHE_NONEÿǶִshade_vertex()
+template <class ShaderT> void draw_indexed(int nfaces, const int *indices, int nverts, ShaderT &shader, TGAImage &image, DepthBuffer &zbuffer) {
+    int nv = shader.nvaryings();
+    if (!nv) {
+        draw(nfaces, shader, image, zbuffer);
+        return;
+    }
+    shader.prepare(current_uniforms());
+    if (Pipeline.vertex_cache!=VCACHE_PREPASS) {
+        //fetchֻڴлƻֿǰ˰ύ˳ãֿʱÿĽ汣棬̲߳ٷʻ
+        VertexCache cache(Pipeline.vertex_cache_size, nv);
+        std::vector<float> corners(3*nv); //ǰǵvaryingۿܱͬһĺ滻
+        long long misses = 0;
+        draw_faces(nfaces, shader, image, zbuffer, [&](ShaderT &s, int, int iface, Vec4f *pts, float *vary) {
+            const int *idx = indices + iface*3;
+            float *v = vary ? vary : corners.data();
+            for (int j=0; j<3; j++) {
+                if (Pipeline.vertex_cache==VCACHE_NONE) {
+                    pts[j] = s.shade_vertex(idx[j], v+j*nv);
+                    misses++;
+                    continue;
+                }
+                int slot = cache.fetch(s, idx[j], misses);
+                pts[j] = cache.position(slot);
+                memcpy(v+j*nv, cache.varyings(slot), nv*sizeof(float));
+            }
+            if (!vary) s.load_varyings(v, v+nv, v+2*nv);
+            return true;
+        });
+        Stats.vertices += misses;
+        return;
+    }
+
+    std::vector<Vec4f> positions(nverts);
+    std::vector<float> varyings((size_t)nverts*nv);
+    const ShaderT &vs = shader;
+    int workers = std::max(1, std::min(worker_count(), nverts/1024));
+    run_workers(workers, [&](int w) {
+        int begin = (int)((long long)nverts*w/workers), end = (int)((long long)nverts*(w+1)/workers);
+        for (int i=begin; i<end; i++) positions[i] = vs.shade_vertex(i, &varyings[(size_t)i*nv]);
+    });
+    Stats.vertices += nverts;
+
+    const float *vary = varyings.data();
+    draw_faces(nfaces, shader, image, zbuffer, [&](ShaderT &s, int, int iface, Vec4f *pts, float *dst) {
+        const int *idx = indices + iface*3;
+        for (int j=0; j<3; j++) pts[j] = positions[idx[j]];
+        if (!dst) s.load_varyings(vary+(size_t)idx[0]*nv, vary+(size_t)idx[1]*nv, vary+(size_t)idx[2]*nv);
+        else for (int j=0; j<3; j++) memcpy(dst+j*nv, vary+(size_t)idx[j]*nv, nv*sizeof(float));
+        return true;
+    });
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+
+// 8-lane float vector for the batched fragment path.
+// The instruction set is picked when compiling: AVX, two SSE registers, or plain floats.
+// The ReleaseAVX2 configuration builds with /arch:AVX2 to get the AVX path, the others use SSE2;
+// cpu_simd_level() only decides whether batching is enabled, it does not switch paths at run time.
+#if defined(__AVX__)
+#define FLOAT8_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define FLOAT8_SSE
+#include <emmintrin.h>
+#else
+#define FLOAT8_SCALAR
+#endif
+
+enum SimdLevel {
+    SIMD_SCALAR=0, SIMD_SSE2=1, SIMD_AVX=2
+};
+
+#if defined(FLOAT8_AVX)
+const SimdLevel FLOAT8_LEVEL = SIMD_AVX;
+#elif defined(FLOAT8_SSE)
+const SimdLevel FLOAT8_LEVEL = SIMD_SSE2;
+#else
+const SimdLevel FLOAT8_LEVEL = SIMD_SCALAR;
+#endif
+
+SimdLevel cpu_simd_level();
+
+/////////////////////////////////////////////////////////////////////////////////
+
+#if defined(FLOAT8_AVX)
+
+struct float8 {
+    __m256 v;
+    float8() : v(_mm256_setzero_ps()) {}
+    float8(float f) : v(_mm256_set1_ps(f)) {}
+    float8(__m256 m) : v(m) {}
+    static float8 load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline float8 operator+(float8 a, float8 b) { return _mm256_add_ps(a.v, b.v); }
+inline float8 operator-(float8 a, float8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline float8 operator*(float8 a, float8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline float8 operator/(float8 a, float8 b) { return _mm256_div_ps(a.v, b.v); }
+inline float8 min(float8 a, float8 b) { return _mm256_min_ps(a.v, b.v); }
+inline float8 max(float8 a, float8 b) { return _mm256_max_ps(a.v, b.v); }
+inline float8 sqrt(float8 a) { return _mm256_sqrt_ps(a.v); }
+inline float8 operator>(float8 a, float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+// picks a where the mask lane is set, b elsewhere
+inline float8 select(float8 mask, float8 a, float8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int movemask(float8 mask) { return _mm256_movemask_ps(mask.v); }
+
+#elif defined(FLOAT8_SSE)
+
+struct float8 {
+    __m128 lo, hi;
+    float8() : lo(_mm_setzero_ps()), hi(_mm_setzero_ps()) {}
+    float8(float f) : lo(_mm_set1_ps(f)), hi(_mm_set1_ps(f)) {}
+    float8(__m128 l, __m128 h) : lo(l), hi(h) {}
+    static float8 load(const float *p) { return float8(_mm_loadu_ps(p), _mm_loadu_ps(p+4)); }
+    void store(float *p) const { _mm_storeu_ps(p, lo); _mm_storeu_ps(p+4, hi); }
+};
+
+inline float8 operator+(float8 a, float8 b) { return float8(_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi)); }
+inline float8 operator-(float8 a, float8 b) { return float8(_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi)); }
+inline float8 operator*(float8 a, float8 b) { return float8(_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)); }
+inline float8 operator/(float8 a, float8 b) { return float8(_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi)); }
+inline float8 min(float8 a, float8 b) { return float8(_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi)); }
+inline float8 max(float8 a, float8 b) { return float8(_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi)); }
+inline float8 sqrt(float8 a) { return float8(_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)); }
+inline float8 operator>(float8 a, float8 b) { return float8(_mm_cmpgt_ps(a.lo, b.lo), _mm_cmpgt_ps(a.hi, b.hi)); }
+inline float8 select(float8 mask, float8 a, float8 b) {
+    return float8(_mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo)),
+                  _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi)));
+}
+inline int movemask(float8 mask) { return _mm_movemask_ps(mask.lo) | (_mm_movemask_ps(mask.hi)<<4); }
+
+#else
+
+struct float8 {
+    float f[8];
+    float8() { for (int i=8; i--; f[i]=0.f); }
+    float8(float s) { for (int i=8; i--; f[i]=s); }
+    static float8 load(const float *p) { float8 r; for (int i=8; i--; r.f[i]=p[i]); return r; }
+    void store(float *p) const { for (int i=8; i--; p[i]=f[i]); }
+};
+
+#define FLOAT8_OP(expr) float8 r; for (int i=8; i--; r.f[i]=(expr)); return r;
+inline float8 operator+(float8 a, float8 b) { FLOAT8_OP(a.f[i]+b.f[i]) }
+inline float8 operator-(float8 a, float8 b) { FLOAT8_OP(a.f[i]-b.f[i]) }
+inline float8 operator*(float8 a, float8 b) { FLOAT8_OP(a.f[i]*b.f[i]) }
+inline float8 operator/(float8 a, float8 b) { FLOAT8_OP(a.f[i]/b.f[i]) }
+inline float8 min(float8 a, float8 b) { FLOAT8_OP(std::min(a.f[i], b.f[i])) }
+inline float8 max(float8 a, float8 b) { FLOAT8_OP(std::max(a.f[i], b.f[i])) }
+inline float8 sqrt(float8 a) { FLOAT8_OP(std::sqrt(a.f[i])) }
+inline float8 operator>(float8 a, float8 b) {
+    float8 r;
+    for (int i=8; i--; ) {
+        unsigned int bits = a.f[i]>b.f[i] ? 0xffffffffu : 0u;
+        memcpy(&r.f[i], &bits, sizeof(float));
+    }
+    return r;
+}
+inline int movemask(float8 mask) {
+    int m = 0;
+    for (int i=8; i--; ) {
+        unsigned int bits;
+        memcpy(&bits, &mask.f[i], sizeof(float));
+        m |= (bits>>31)<<i;
+    }
+    return m;
+}
+inline float8 select(float8 mask, float8 a, float8 b) { FLOAT8_OP((movemask(mask)>>i)&1 ? a.f[i] : b.f[i]) }
+#undef FLOAT8_OP
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// 3-component vector of float8 lanes, structure of arrays
+struct vec3f8 {
+    float8 x, y, z;
+    vec3f8() : x(), y(), z() {}
+    vec3f8(float8 X, float8 Y, float8 Z) : x(X), y(Y), z(Z) {}
+};
+
+inline vec3f8 operator+(const vec3f8 &a, const vec3f8 &b) { return vec3f8(a.x+b.x, a.y+b.y, a.z+b.z); }
+inline vec3f8 operator-(const vec3f8 &a, const vec3f8 &b) { return vec3f8(a.x-b.x, a.y-b.y, a.z-b.z); }
+inline vec3f8 operator*(const vec3f8 &a, float8 s) { return vec3f8(a.x*s, a.y*s, a.z*s); }
+inline float8 dot(const vec3f8 &a, const vec3f8 &b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+inline vec3f8 normalize(const vec3f8 &a) { return a*(float8(1.f)/sqrt(dot(a, a))); }
@@ -0,0 +1,110 @@
+#include "texture.h"
+
+float uv_lod(Vec2f duvdx, Vec2f duvdy) {
+    float rho2 = std::max(duvdx.x*duvdx.x + duvdx.y*duvdx.y, duvdy.x*duvdy.x + duvdy.y*duvdy.y);
+    return rho2>0 ? .5f*std::log2(rho2) : LOD_FULL;
+}
+
+void Texture::assign(int w, int h, int bytespp, const unsigned char *texels) {
+    bytespp_ = bytespp;
+    layout(w, h);
+    if (empty() || !texels || bytespp<1 || bytespp>4) {
+        layout(0, 0);
+        return;
+    }
+    allocate();
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++)
+            memcpy(&texel(0, x, y), texels+((size_t)x+(size_t)y*w)*bytespp, bytespp);
+    // each texel averages a 2x2 block of the level above, the last row or column is reused for odd sizes
+    for (int i=1; i<nlevels(); i++) {
+        const Level &src = levels_[i-1], &dst = levels_[i];
+        for (int y=0; y<dst.height; y++) {
+            int y0 = std::min(2*y, src.height-1), y1 = std::min(2*y+1, src.height-1);
+            for (int x=0; x<dst.width; x++) {
+                int x0 = std::min(2*x, src.width-1), x1 = std::min(2*x+1, src.width-1);
+                const unsigned char *p[4] = { (const unsigned char *)at(src, x0, y0), (const unsigned char *)at(src, x1, y0),
+                                              (const unsigned char *)at(src, x0, y1), (const unsigned char *)at(src, x1, y1) };
+                unsigned char *out = (unsigned char *)&texel(i, x, y);
+                for (int c=0; c<4; c++) out[c] = (unsigned char)((p[0][c]+p[1][c]+p[2][c]+p[3][c]+2)/4);
+            }
+        }
+    }
+}
+
+void Texture::assign(TGAImage &img) {
+    assign(img.get_width(), img.get_height(), img.get_bytespp(), img.buffer());
+}
+
+bool Texture::view(int w, int h, int bytespp, const void *data, size_t bytes) {
+    bytespp_ = bytespp;
+    layout(w, h);
+    return bytespp>=1 && bytespp<=4 ? view_data(data, bytes) : view_data(NULL, 0);
+}
+
+TGAColor Texture::sample(Vec2f uv, float lod, TextureFilter filter) const {
+    if (empty()) return TGAColor();
+    if (filter==FILTER_NEAREST) {
+        // truncation and black outside the image, exactly like TGAImage::get()
+        Vec2i p(uv[0]*levels_[0].width, uv[1]*levels_[0].height);
+        return fetch(p.x, p.y);
+    }
+    float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+    this->filter(uv, lod, filter, [&](uint32_t t, float w) {
+        const unsigned char *c = (const unsigned char *)&t;
+        for (int i=0; i<4; i++) sum[i] += c[i]*w;
+    });
+    TGAColor res;
+    res.bytespp = (unsigned char)bytespp_;
+    for (int i=0; i<4; i++) res.bgra[i] = (unsigned char)std::min(sum[i]+.5f, 255.f);
+    return res;
+}
+
+// a texel of the original byte decoding: channel/255*2-1, bgr to zyx
+static Vec3f decode_normal(const unsigned char *bgr) {
+    Vec3f n;
+    for (int i=0; i<3; i++) n[2-i] = (float)bgr[i]/255.f*2.f - 1.f;
+    return n;
+}
+
+void NormalMap::assign(TGAImage &img) {
+    int w = img.get_width(), h = img.get_height(), bytespp = img.get_bytespp();
+    layout(w, h);
+    if (empty() || !img.buffer() || bytespp<3) {
+        layout(0, 0);
+        return;
+    }
+    allocate();
+    for (int y=0; y<h; y++)
+        for (int x=0; x<w; x++)
+            texel(0, x, y) = decode_normal(img.buffer()+((size_t)x+(size_t)y*w)*bytespp).normalize();
+    for (int i=1; i<nlevels(); i++) {
+        const Level &src = levels_[i-1], &dst = levels_[i];
+        for (int y=0; y<dst.height; y++) {
+            int y0 = std::min(2*y, src.height-1), y1 = std::min(2*y+1, src.height-1);
+            for (int x=0; x<dst.width; x++) {
+                int x0 = std::min(2*x, src.width-1), x1 = std::min(2*x+1, src.width-1);
+                Vec3f n = *at(src, x0, y0) + *at(src, x1, y0) + *at(src, x0, y1) + *at(src, x1, y1);
+                // opposite normals cancel out, keep one of them
+                texel(i, x, y) = n.norm()>1e-6f ? n.normalize() : *at(src, x0, y0);
+            }
+        }
+    }
+}
+
+bool NormalMap::view(int w, int h, const void *data, size_t bytes) {
+    layout(w, h);
+    return view_data(data, bytes);
+}
+
+Vec3f NormalMap::sample(Vec2f uv, float lod, TextureFilter filter) const {
+    static const unsigned char black[3] = { 0, 0, 0 };
+    if (filter==FILTER_NEAREST || empty()) {
+        Vec2i p(uv[0]*width(), uv[1]*height());
+        if (empty() || p.x<0 || p.y<0 || p.x>=width() || p.y>=height()) return decode_normal(black);
+        return *at(levels_[0], p.x, p.y);
+    }
+    Vec3f sum(0, 0, 0);
+    this->filter(uv, lod, filter, [&](const Vec3f &n, float w) { sum = sum + n*w; });
+    return sum;
+}
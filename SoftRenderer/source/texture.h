@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "geometry.h"
+#include "tgaimage.h"
+
+enum TextureFilter {
+    FILTER_NEAREST,   // nearest texel of the full resolution image, the original lookup
+    FILTER_BILINEAR,  // bilinear in the mip level closest to the footprint
+    FILTER_TRILINEAR  // bilinear in the two mip levels around the footprint, blended (default)
+};
+
+// level of detail of a full resolution lookup, for callers without derivatives
+const float LOD_FULL = -128.f;
+
+// log2 of the longer screen space uv derivative, the level of detail in uv units;
+// sampling adds log2 of the texture size to get the mip level
+float uv_lod(Vec2f duvdx, Vec2f duvdy);
+
+// mip pyramid of T texels down to 1x1, uv outside [0,1] is clamped to the edge texels.
+// A level is stored as 4x4 tiles, the texels of a tile in Z (Morton) order and the tiles row by row,
+// so a bilinear footprint or a diagonal walk touches few cache lines.
+// All levels share one 64-byte aligned block that is either owned or a view of memory owned elsewhere
+// (the mesh cache mapping).
+template <class T> class MipPyramid {
+public:
+    static const int TILE = 4;
+protected:
+    struct Level {
+        int width, height;
+        int tiles_w;   // tiles per row
+        size_t offset; // first texel of the level in data_
+    };
+    std::vector<Level> levels_;
+    std::vector<unsigned char> owned_;
+    const T *data_;
+    size_t size_;      // texels of all levels, padding of the edge tiles included
+    float log2_size_;  // log2 of the larger side of level 0
+
+    // sizes and offsets of all levels, the texels come from allocate() or view_data()
+    void layout(int w, int h) {
+        levels_.clear();
+        std::vector<unsigned char>().swap(owned_);
+        data_ = NULL;
+        size_ = 0;
+        log2_size_ = 0.f;
+        if (w<=0 || h<=0) return;
+        log2_size_ = std::log2((float)std::max(w, h));
+        for (;;) {
+            Level l = { w, h, (w+TILE-1)/TILE, size_ };
+            size_ += (size_t)l.tiles_w*((h+TILE-1)/TILE)*TILE*TILE;
+            levels_.push_back(l);
+            if (w==1 && h==1) break;
+            w = std::max(1, w/2);
+            h = std::max(1, h/2);
+        }
+    }
+    // zeroed storage for the current layout
+    T *allocate() {
+        owned_.assign(size_*sizeof(T)+63, 0);
+        unsigned char *p = owned_.data();
+        T *base = (T *)(p + (64-(uintptr_t)p%64)%64);
+        data_ = base;
+        return base;
+    }
+    bool view_data(const void *data, size_t bytes) {
+        if (levels_.empty() || !data || bytes!=size_*sizeof(T) || (uintptr_t)data%alignof(T)) {
+            layout(0, 0);
+            return false;
+        }
+        data_ = (const T *)data;
+        return true;
+    }
+    const T *at(const Level &l, int x, int y) const {
+        int morton = (x&1) | (y&1)<<1 | (x&2)<<1 | (y&2)<<2;
+        return data_ + l.offset + ((size_t)(x>>2) + (size_t)(y>>2)*l.tiles_w)*(TILE*TILE) + morton;
+    }
+    // writable texel of owned storage, for building the levels
+    T &texel(int level, int x, int y) { return const_cast<T &>(*at(levels_[level], x, y)); }
+
+    // the four texels around uv in level l and their weights
+    template <class F> void bilinear(const Level &l, Vec2f uv, float weight, F &tap) const {
+        // texel centers at half integers
+        float x = std::min(std::max(uv.x, 0.f), 1.f)*l.width  - .5f;
+        float y = std::min(std::max(uv.y, 0.f), 1.f)*l.height - .5f;
+        int x0 = (int)(x+1.f)-1, y0 = (int)(y+1.f)-1; // floor, x and y are at least -.5
+        float fx = x-x0, fy = y-y0;
+        int x1 = std::min(x0+1, l.width-1), y1 = std::min(y0+1, l.height-1);
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        tap(*at(l, x0, y0), weight*(1-fx)*(1-fy));
+        tap(*at(l, x1, y0), weight*fx*(1-fy));
+        tap(*at(l, x0, y1), weight*(1-fx)*fy);
+        tap(*at(l, x1, y1), weight*fx*fy);
+    }
+    // calls tap(texel, weight) for the texels of a bilinear or trilinear lookup, the weights add up to 1;
+    // FILTER_NEAREST is left to the caller, it keeps the original truncation
+    template <class F> void filter(Vec2f uv, float lod, TextureFilter filter, F tap) const {
+        float level = lod + log2_size_;
+        int last = (int)levels_.size()-1;
+        if (!(level>0)) bilinear(levels_[0], uv, 1.f, tap); // magnified, also catches NaN
+        else if (level>=last) bilinear(levels_[last], uv, 1.f, tap);
+        else if (filter==FILTER_BILINEAR) bilinear(levels_[(int)(level+.5f)], uv, 1.f, tap);
+        else {
+            int l0 = (int)level;
+            float t = level-l0;
+            bilinear(levels_[l0],   uv, 1.f-t, tap);
+            bilinear(levels_[l0+1], uv, t,     tap);
+        }
+    }
+public:
+    MipPyramid() : levels_(), owned_(), data_(NULL), size_(0), log2_size_(0.f) {}
+    MipPyramid(const MipPyramid &) = delete;
+    MipPyramid &operator =(const MipPyramid &) = delete;
+
+    bool empty() const { return levels_.empty(); }
+    int width() const { return empty() ? 0 : levels_[0].width; }
+    int height() const { return empty() ? 0 : levels_[0].height; }
+    int nlevels() const { return (int)levels_.size(); }
+    // the whole pyramid, what view() takes back
+    const void *data() const { return data_; }
+    size_t bytes() const { return size_*sizeof(T); }
+};
+
+// color texture, texels are 4 bytes (bgra with the channels past bytespp() zero) so a tile is 64 bytes, one cache line;
+// the levels are box filtered
+class Texture : public MipPyramid<uint32_t> {
+    int bytespp_;
+public:
+    Texture() : bytespp_(1) {}
+
+    // converts w x h row-major texels of bytespp bytes and builds the smaller levels
+    void assign(int w, int h, int bytespp, const unsigned char *texels);
+    void assign(TGAImage &img);
+    // uses a pyramid stored by an earlier data()/bytes() without copying, false when bytes does not match w, h
+    bool view(int w, int h, int bytespp, const void *data, size_t bytes);
+    int bytespp() const { return bytespp_; }
+
+    // texel (x,y) of a level, black outside it
+    TGAColor fetch(int x, int y, int level=0) const {
+        TGAColor c;
+        if (level<0 || level>=nlevels()) return c;
+        const Level &l = levels_[level];
+        if (x<0 || y<0 || x>=l.width || y>=l.height) return c;
+        memcpy(c.bgra, at(l, x, y), 4);
+        c.bytespp = (unsigned char)bytespp_;
+        return c;
+    }
+    // lod is uv_lod() of the pixel footprint, an empty texture returns black
+    TGAColor sample(Vec2f uv, float lod, TextureFilter filter) const;
+};
+
+// tangent space normal map decoded once when loaded: texels are unit vectors (x,y,z) in [-1,1],
+// the levels average and renormalize the vectors of the level above.
+// Filtered lookups blend unit vectors and come out slightly shorter, normalize after transforming them.
+class NormalMap : public MipPyramid<Vec3f> {
+public:
+    // decodes a 24 or 32 bit normal map, r,g,b = x,y,z
+    void assign(TGAImage &img);
+    bool view(int w, int h, const void *data, size_t bytes);
+
+    // lod is uv_lod() of the pixel footprint, an empty map returns the decoded black texel like FILTER_NEAREST outside it
+    Vec3f sample(Vec2f uv, float lod, TextureFilter filter) const;
+};
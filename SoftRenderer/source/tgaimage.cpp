@@ -3,7 +3,13 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <thread>
+#include <atomic>
 #include "tgaimage.h"
+#include "mapped_file.h"
 
 TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {
 }
@@ -40,45 +46,47 @@ TGAImage & TGAImage::operator =(const TGAImage &img) {
 bool TGAImage::read_tga_file(const char *filename) {
     if (data) delete [] data;
     data = NULL;
-    std::ifstream in;
-    in.open (filename, std::ios::binary);
-    if (!in.is_open()) {
+    // the whole file is mapped, the pixels are decoded with bulk copies
+    MappedFile file;
+    if (!file.open(filename)) {
         std::cerr << "can't open file " << filename << "\n";
-        in.close();
         return false;
     }
+    const unsigned char *src = file.data();
+    size_t size = file.size();
     TGA_Header header;
-    in.read((char *)&header, sizeof(header));
-    if (!in.good()) {
-        in.close();
+    if (size<sizeof(header)) {
         std::cerr << "an error occured while reading the header\n";
         return false;
     }
+    memcpy(&header, src, sizeof(header));
     width   = header.width;
     height  = header.height;
     bytespp = header.bitsperpixel>>3;
     if (width<=0 || height<=0 || (bytespp!=GRAYSCALE && bytespp!=RGB && bytespp!=RGBA)) {
-        in.close();
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
+    // the pixels follow the image id field
+    size_t pos = sizeof(header) + (unsigned char)header.idlength;
+    if (pos>size) {
+        std::cerr << "an error occured while reading the header\n";
+        return false;
+    }
     unsigned long nbytes = bytespp*width*height;
     data = new unsigned char[nbytes];
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read((char *)data, nbytes);
-        if (!in.good()) {
-            in.close();
+        if (size-pos<nbytes) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
+        memcpy(data, src+pos, nbytes);
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
-            in.close();
+        if (!load_rle_data(src+pos, size-pos)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
     } else {
-        in.close();
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
@@ -89,7 +97,6 @@ bool TGAImage::read_tga_file(const char *filename) {
         flip_horizontally();
     }
     std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
-    in.close();
     return true;
 }
 
@@ -142,7 +149,102 @@ bool TGAImage::load_rle_data(std::ifstream &in) {
     return true;
 }
 
-bool TGAImage::write_tga_file(const char *filename, bool rle) {
+// src holds size bytes of packets; a run is filled by doubling copies of its first pixel
+bool TGAImage::load_rle_data(const unsigned char *src, size_t size) {
+    size_t nbytes = (size_t)width*height*bytespp;
+    size_t pos = 0, out = 0;
+    while (out<nbytes) {
+        if (pos>=size) {
+            std::cerr << "an error occured while reading the data\n";
+            return false;
+        }
+        unsigned char chunkheader = src[pos++];
+        size_t len = ((chunkheader&0x7f)+1)*(size_t)bytespp;
+        if (len>nbytes-out) {
+            std::cerr << "Too many pixels read\n";
+            return false;
+        }
+        size_t packet = chunkheader<128 ? len : bytespp;
+        if (packet>size-pos) {
+            std::cerr << "an error occured while reading the data\n";
+            return false;
+        }
+        unsigned char *dst = data+out;
+        if (chunkheader<128) {
+            memcpy(dst, src+pos, len);
+        } else if (bytespp==1) {
+            memset(dst, src[pos], len);
+        } else if (len<=32) {
+            // short runs, mostly a few pixels
+            for (size_t i=0; i<len; i+=bytespp) memcpy(dst+i, src+pos, bytespp);
+        } else {
+            memcpy(dst, src+pos, bytespp);
+            for (size_t done=bytespp; done<len; done*=2)
+                memcpy(dst+done, dst, std::min(done, len-done));
+        }
+        pos += packet;
+        out += len;
+    }
+    return true;
+}
+
+bool TGAImage::read_tga_file_legacy(const char *filename) {
+    if (data) delete [] data;
+    data = NULL;
+    std::ifstream in;
+    in.open (filename, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        in.close();
+        return false;
+    }
+    TGA_Header header;
+    in.read((char *)&header, sizeof(header));
+    if (!in.good()) {
+        in.close();
+        std::cerr << "an error occured while reading the header\n";
+        return false;
+    }
+    width   = header.width;
+    height  = header.height;
+    bytespp = header.bitsperpixel>>3;
+    if (width<=0 || height<=0 || (bytespp!=GRAYSCALE && bytespp!=RGB && bytespp!=RGBA)) {
+        in.close();
+        std::cerr << "bad bpp (or width/height) value\n";
+        return false;
+    }
+    unsigned long nbytes = bytespp*width*height;
+    data = new unsigned char[nbytes];
+    if (3==header.datatypecode || 2==header.datatypecode) {
+        in.read((char *)data, nbytes);
+        if (!in.good()) {
+            in.close();
+            std::cerr << "an error occured while reading the data\n";
+            return false;
+        }
+    } else if (10==header.datatypecode||11==header.datatypecode) {
+        if (!load_rle_data(in)) {
+            in.close();
+            std::cerr << "an error occured while reading the data\n";
+            return false;
+        }
+    } else {
+        in.close();
+        std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
+        return false;
+    }
+    if (!(header.imagedescriptor & 0x20)) {
+        flip_vertically();
+    }
+    if (header.imagedescriptor & 0x10) {
+        flip_horizontally();
+    }
+    std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
+    in.close();
+    return true;
+}
+
+bool TGAImage::write_tga_file(const char *filename, bool rle, int stripe_rows, int threads) {
     unsigned char developer_area_ref[4] = {0, 0, 0, 0};
     unsigned char extension_area_ref[4] = {0, 0, 0, 0};
     unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
@@ -174,7 +276,7 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
             return false;
         }
     } else {
-        if (!unload_rle_data(out)) {
+        if (!unload_rle_data(out, stripe_rows, threads)) {
             out.close();
             std::cerr << "can't unload rle data\n";
             return false;
@@ -202,49 +304,140 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) {
-    const unsigned char max_chunk_length = 128;
-    unsigned long npixels = width*height;
-    unsigned long curpix = 0;
-    while (curpix<npixels) {
-        unsigned long chunkstart = curpix*bytespp;
-        unsigned long curbyte = curpix*bytespp;
-        unsigned char run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bytespp; t++) {
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bytespp]);
-            }
-            curbyte += bytespp;
-            if (1==run_length) {
-                raw = !succ_eq;
-            }
-            if (raw && succ_eq) {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq) {
-                break;
-            }
-            run_length++;
+// pixels equal to the one at p, p included, at most max of them;
+// pixel n equals pixel 0 when every byte before it equals the one bytespp further, compared 8 bytes at a time
+static size_t run_length(const unsigned char *p, size_t max, int bytespp) {
+    size_t nbytes = (max-1)*bytespp, i = 0;
+    for (; i+8<=nbytes; i+=8) {
+        uint64_t a, b;
+        memcpy(&a, p+i, 8);
+        memcpy(&b, p+i+bytespp, 8);
+        if (a!=b) break;
+    }
+    while (i<nbytes && p[i]==p[i+bytespp]) i++;
+    return 1 + i/bytespp;
+}
+
+// packets are staged and handed to flush(bytes, size) in blocks of about RLE_STAGE bytes
+const size_t RLE_STAGE = 1<<18;
+
+template <int BPP, class F> static void encode_rle(const unsigned char *pixels, size_t npixels, F &flush) {
+    const size_t max_chunk_length = 128;
+    std::vector<unsigned char> stage(RLE_STAGE + 1 + max_chunk_length*BPP);
+    size_t staged = 0;
+    auto packet = [&](unsigned char header, const unsigned char *src, size_t bytes) {
+        stage[staged++] = header;
+        memcpy(&stage[staged], src, bytes);
+        staged += bytes;
+        if (staged>=RLE_STAGE) {
+            flush(stage.data(), staged);
+            staged = 0;
         }
-        curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+    };
+    auto raw_packets = [&](size_t first, size_t last) {
+        for (size_t n; first<last; first+=n) {
+            n = std::min(last-first, max_chunk_length);
+            packet((unsigned char)(n-1), pixels+first*BPP, n*BPP);
         }
-        out.write((char *)(data+chunkstart), (raw?run_length*bytespp:bytespp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+    };
+    size_t raw_start = 0, cur = 0;
+    while (cur<npixels) {
+        const unsigned char *p = pixels+cur*BPP;
+        size_t n = cur+1<npixels && !memcmp(p, p+BPP, BPP) ? run_length(p, std::min(npixels-cur, max_chunk_length), BPP) : 1;
+        // a run inside raw pixels costs a run packet plus the header of the raw packet after it:
+        // with 3 or 4 byte pixels two equal ones are already worth it, gray pixels need three,
+        // or two when no raw packet has to be broken
+        if (n>=2 && (BPP>1 || n>=3 || raw_start==cur)) {
+            raw_packets(raw_start, cur);
+            packet((unsigned char)(n+127), p, BPP);
+            raw_start = cur+n;
         }
+        cur += n;
+    }
+    raw_packets(raw_start, npixels);
+    if (staged) flush(stage.data(), staged);
+}
+
+// appends the packets of npixels pixels, dispatches to the fixed pixel size compares
+template <class F> static void encode_rle(const unsigned char *pixels, size_t npixels, int bytespp, F flush) {
+    switch (bytespp) {
+    case 1:  encode_rle<1>(pixels, npixels, flush); break;
+    case 3:  encode_rle<3>(pixels, npixels, flush); break;
+    default: encode_rle<4>(pixels, npixels, flush); break;
+    }
+}
+
+bool TGAImage::unload_rle_data(std::ofstream &out, int stripe_rows, int threads) {
+    int nstripes = stripe_rows>0 ? (height+stripe_rows-1)/stripe_rows : 1;
+    if (nstripes<=1) {
+        encode_rle(data, (size_t)width*height, bytespp, [&](const unsigned char *bytes, size_t size) {
+            out.write((const char *)bytes, size);
+        });
+    } else {
+        // every stripe is a stream of its own, the threads take the next stripe from a shared counter
+        // and the stripes are written in order once all of them are encoded
+        if (threads<=0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+        threads = std::min(threads, nstripes);
+        std::vector<std::vector<unsigned char> > stripes(nstripes);
+        std::atomic<int> next(0);
+        size_t stripe_pixels = (size_t)width*stripe_rows;
+        auto job = [&]() {
+            for (int i; (i = next++)<nstripes; ) {
+                size_t first = stripe_pixels*i;
+                size_t npixels = std::min(stripe_pixels, (size_t)width*height-first);
+                encode_rle(data+first*bytespp, npixels, bytespp, [&](const unsigned char *bytes, size_t size) {
+                    stripes[i].insert(stripes[i].end(), bytes, bytes+size);
+                });
+            }
+        };
+        std::vector<std::thread> pool;
+        for (int t=1; t<threads; t++) pool.push_back(std::thread(job));
+        job();
+        for (size_t t=0; t<pool.size(); t++) pool[t].join();
+        for (int i=0; i<nstripes && out.good(); i++) out.write((const char *)stripes[i].data(), stripes[i].size());
+    }
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
     }
     return true;
 }
 
+bool TGAImage::write_ppm_file(const char *filename) {
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    bool ok = write_ppm(f);
+    ok = fclose(f)==0 && ok;
+    if (!ok) std::cerr << "can't dump the ppm file\n";
+    return ok;
+}
+
+bool TGAImage::write_ppm(FILE *f) {
+    if (!data) return false;
+    fprintf(f, "%s\n%d %d\n255\n", bytespp==GRAYSCALE ? "P5" : "P6", width, height);
+    return write_raw(f);
+}
+
+bool TGAImage::write_raw(FILE *f) {
+    if (!data) return false;
+    if (bytespp==GRAYSCALE) return fwrite(data, 1, (size_t)width*height, f)==(size_t)width*height && !ferror(f);
+    // bgr(a) to rgb, a row at a time
+    std::vector<unsigned char> row(width*3);
+    for (int y=0; y<height; y++) {
+        const unsigned char *src = data+(size_t)y*width*bytespp;
+        for (int x=0; x<width; x++, src+=bytespp) {
+            row[x*3]   = src[2];
+            row[x*3+1] = src[1];
+            row[x*3+2] = src[0];
+        }
+        if (fwrite(row.data(), 1, row.size(), f)!=row.size()) return false;
+    }
+    return !ferror(f);
+}
+
 TGAColor TGAImage::get(int x, int y) {
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return TGAColor();
@@ -314,6 +507,13 @@ unsigned char *TGAImage::buffer() {
     return data;
 }
 
+void TGAImage::swap(TGAImage &img) {
+    std::swap(data, img.data);
+    std::swap(width, img.width);
+    std::swap(height, img.height);
+    std::swap(bytespp, img.bytespp);
+}
+
 void TGAImage::clear() {
     memset((void *)data, 0, width*height*bytespp);
 }
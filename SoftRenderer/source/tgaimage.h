@@ -2,6 +2,8 @@
 
 
 #include <fstream>
+#include <cstddef>
+#include <cstdio>
 
 #pragma pack(push,1)
 struct TGA_Header {
@@ -71,7 +73,8 @@ protected:
     int bytespp;
 
     bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    bool   load_rle_data(const unsigned char *src, size_t size);
+    bool unload_rle_data(std::ofstream &out, int stripe_rows, int threads);
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
@@ -81,7 +84,16 @@ public:
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
     bool read_tga_file(const char *filename);
-    bool write_tga_file(const char *filename, bool rle=true);
+    bool read_tga_file_legacy(const char *filename); // the original istream reader, kept for "bench tga"
+    // stripe_rows>0 ends the RLE packets at every stripe_rows rows and encodes the stripes on separate threads
+    // (threads: 0 = std::thread::hardware_concurrency()); the file depends on stripe_rows only, not on threads
+    bool write_tga_file(const char *filename, bool rle=true, int stripe_rows=0, int threads=0);
+    // uncompressed outputs that other tools read without a TGA decoder, rows in memory order (top first after
+    // the flip_vertically() of main): binary PPM (P6, rgb, alpha dropped) or PGM (P5) for GRAYSCALE
+    bool write_ppm_file(const char *filename);
+    bool write_ppm(FILE *f);
+    // bare rgb24 or gray8 pixels without a header, for a video encoder reading frames from a pipe
+    bool write_raw(FILE *f);
     bool flip_horizontally();
     bool flip_vertically();
     bool scale(int w, int h);
@@ -90,6 +102,7 @@ public:
     bool set(int x, int y, const TGAColor &c);
     ~TGAImage();
     TGAImage & operator =(const TGAImage &img);
+    void swap(TGAImage &img); // exchanges the pixels without copying them
     int get_width();
     int get_height();
     int get_bytespp();